@@ -0,0 +1,168 @@
+#!/bin/sh
+#
+# tick_overhead.sh
+#		Measure the per round overhead of pg_rage_terminator against the
+#		number of idle connections.
+#
+# Prints one CSV line per scan mode and connection count:
+#
+#	mode,connections,rounds,wall_ms,cpu_ms,snapshot_ms,rss_kb
+#
+# With BENCH_MAX_WALL_MS or BENCH_MAX_RSS_KB set, exits with status 1 if a
+# measurement goes over the budget.
+#
+# The server is selected through the usual libpq environment variables.
+# See README.md for the requirements.
+#
+
+set -e
+
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+BENCH_CONNECTIONS=${BENCH_CONNECTIONS:-"100 1000 5000 10000"}
+BENCH_MODES=${BENCH_MODES:-"sql native"}
+BENCH_DURATION=${BENCH_DURATION:-30}
+BENCH_INTERVAL=${BENCH_INTERVAL:-100ms}
+BENCH_MAX_WALL_MS=${BENCH_MAX_WALL_MS:-}
+BENCH_MAX_RSS_KB=${BENCH_MAX_RSS_KB:-}
+
+# Application name none of the benchmark connections uses
+NOMATCH=pg_rage_terminator_bench_nomatch
+
+script=$(mktemp)
+pgbench_pid=
+failed=0
+
+psql_cmd()
+{
+	"$PSQL" -X -q -A -t -F ' ' -v ON_ERROR_STOP=1 -c "$1"
+}
+
+set_guc()
+{
+	psql_cmd "ALTER SYSTEM SET pg_rage_terminator.$1 = '$2'"
+}
+
+cleanup()
+{
+	if [ -n "$pgbench_pid" ]; then
+		kill "$pgbench_pid" 2>/dev/null || true
+		wait "$pgbench_pid" 2>/dev/null || true
+	fi
+	for guc in scan_mode interval application_names; do
+		psql_cmd "ALTER SYSTEM RESET pg_rage_terminator.$guc" || true
+	done
+	psql_cmd "SELECT pg_reload_conf()" >/dev/null || true
+	rm -f "$script"
+}
+trap cleanup EXIT INT TERM
+
+# Cumulated round counters of all workers
+counters()
+{
+	psql_cmd "SELECT sum(rounds), sum(total_time), sum(cpu_time), sum(snapshot_time)
+			  FROM pg_rage_terminator_workers"
+}
+
+# Largest resident set size of the workers in kB, empty if the server runs
+# on another host
+worker_rss()
+{
+	for pid in $(psql_cmd "SELECT pid FROM pg_rage_terminator_workers
+						   WHERE pid IS NOT NULL"); do
+		[ -r "/proc/$pid/status" ] && awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status"
+	done | sort -n | tail -n 1
+}
+
+# Wait until the pgbench connections are established
+wait_connections()
+{
+	tries=0
+	while [ "$(psql_cmd "SELECT count(*) FROM pg_stat_activity
+						 WHERE application_name = 'pgbench'")" -lt "$1" ]; do
+		tries=$((tries + 1))
+		if [ $tries -gt 300 ]; then
+			echo "could not open $1 connections" >&2
+			exit 1
+		fi
+		sleep 1
+	done
+}
+
+# The sql scan falls back to native without a database, don't measure the
+# native scan twice
+if [ -z "$(psql_cmd "SHOW pg_rage_terminator.database")" ]; then
+	modes=
+	for mode in $BENCH_MODES; do
+		if [ "$mode" = sql ]; then
+			echo "skipping the sql scan mode, pg_rage_terminator.database is not set" >&2
+		else
+			modes="$modes $mode"
+		fi
+	done
+	BENCH_MODES=$modes
+	if [ -z "$BENCH_MODES" ]; then
+		echo "no scan mode left to measure" >&2
+		exit 1
+	fi
+fi
+
+# Clients spend nearly all their time idle
+printf '\\sleep 1 s\nSELECT 1;\n' > "$script"
+
+echo "mode,connections,rounds,wall_ms,cpu_ms,snapshot_ms,rss_kb"
+
+for connections in $BENCH_CONNECTIONS; do
+	threads=$((connections < 16 ? connections : 16))
+	# libpq prefers PGAPPNAME over the fallback name of pgbench
+	PGAPPNAME=pgbench "$PGBENCH" -n -c "$connections" -j "$threads" \
+		-T $((BENCH_DURATION * 3 + 300)) -f "$script" >/dev/null 2>&1 &
+	pgbench_pid=$!
+	wait_connections "$connections"
+
+	for mode in $BENCH_MODES; do
+		set_guc scan_mode "$mode"
+		set_guc interval "$BENCH_INTERVAL"
+		set_guc application_names "$NOMATCH"
+		psql_cmd "SELECT pg_reload_conf()" >/dev/null
+
+		# Let the workers pick up the settings
+		sleep 2
+		before=$(counters)
+		sleep "$BENCH_DURATION"
+		after=$(counters)
+		rss=$(worker_rss)
+
+		echo "$before $after" | awk -v mode="$mode" -v conns="$connections" \
+			-v rss="$rss" -v max_wall="$BENCH_MAX_WALL_MS" \
+			-v max_rss="$BENCH_MAX_RSS_KB" '{
+			rounds = $5 - $1
+			if (rounds <= 0)
+			{
+				printf "%s,%d,0,,,,%s\n", mode, conns, rss
+				exit 1
+			}
+			wall = ($6 - $2) / rounds
+			printf "%s,%d,%d,%.3f,%.3f,%.3f,%s\n", mode, conns, rounds,
+				wall, ($7 - $3) / rounds, ($8 - $4) / rounds, rss
+			if (max_wall != "" && wall > max_wall + 0)
+			{
+				printf "%s with %d connections: %.3f ms per round, budget is %s ms\n",
+					mode, conns, wall, max_wall > "/dev/stderr"
+				exit 1
+			}
+			if (max_rss != "" && rss != "" && rss + 0 > max_rss + 0)
+			{
+				printf "%s with %d connections: worker RSS %s kB, budget is %s kB\n",
+					mode, conns, rss, max_rss > "/dev/stderr"
+				exit 1
+			}
+		}' || failed=1
+	done
+
+	kill "$pgbench_pid" 2>/dev/null || true
+	wait "$pgbench_pid" 2>/dev/null || true
+	pgbench_pid=
+done
+
+exit $failed
@@ -0,0 +1,138 @@
+/* pg_rage_terminator--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_rage_terminator" to load this file. \quit
+
+-- Kill statistics per database, role and client address
+CREATE FUNCTION pg_rage_terminator_stats(
+    OUT datid oid,
+    OUT userid oid,
+    OUT client_addr inet,
+    OUT kills int8,
+    OUT last_kill timestamptz,
+    OUT dry_run_kills int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_rage_terminator_stats AS
+    SELECT s.datid, d.datname, s.userid, r.rolname AS usename,
+           s.client_addr, s.kills, s.last_kill, s.dry_run_kills
+      FROM pg_rage_terminator_stats() s
+           LEFT JOIN pg_database d ON d.oid = s.datid
+           LEFT JOIN pg_roles r ON r.oid = s.userid;
+
+-- Round statistics per terminator worker, times in milliseconds
+CREATE FUNCTION pg_rage_terminator_workers(
+    OUT worker int4,
+    OUT pid int4,
+    OUT rounds int8,
+    OUT kills int8,
+    OUT total_time float8,
+    OUT last_time float8,
+    OUT skipped int8,
+    OUT cpu_time float8,
+    OUT snapshot_time float8,
+    OUT cancels int8,
+    OUT signal_time float8,
+    OUT paused bool,
+    OUT effective_interval float8,
+    OUT reconnect_time float8,
+    OUT dry_run_kills int8,
+    OUT dry_run_cancels int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_workers'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_rage_terminator_workers AS
+    SELECT * FROM pg_rage_terminator_workers();
+
+-- Kills not counted because pg_rage_terminator.max_stats was reached
+CREATE FUNCTION pg_rage_terminator_stats_dropped()
+RETURNS int8
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_stats_dropped'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Last victims, oldest first
+CREATE FUNCTION pg_rage_terminator_history(
+    OUT pid int4,
+    OUT kill_time timestamptz,
+    OUT datid oid,
+    OUT userid oid,
+    OUT client_addr inet,
+    OUT query_id int8,
+    OUT state text,
+    OUT action text,
+    OUT dry_run bool
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_history'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_rage_terminator_history AS
+    SELECT h.pid, h.kill_time, h.datid, d.datname, h.userid,
+           r.rolname AS usename, h.client_addr, h.query_id, h.state, h.action,
+           h.dry_run
+      FROM pg_rage_terminator_history() h
+           LEFT JOIN pg_database d ON d.oid = h.datid
+           LEFT JOIN pg_roles r ON r.oid = h.userid;
+
+-- Do a kill round right now, returns its victims
+CREATE FUNCTION pg_rage_terminator_fire(
+    chance int4 DEFAULT NULL,
+    OUT pid int4,
+    OUT kill_time timestamptz,
+    OUT datid oid,
+    OUT userid oid,
+    OUT client_addr inet,
+    OUT query_id int8,
+    OUT state text,
+    OUT action text,
+    OUT dry_run bool
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_fire'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION pg_rage_terminator_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_stats_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Start a worker without restarting the server, returns its PID
+CREATE FUNCTION pg_rage_terminator_launch()
+RETURNS int4
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_launch'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- Stop all workers, returns the number of workers signaled
+CREATE FUNCTION pg_rage_terminator_stop()
+RETURNS int4
+AS 'MODULE_PATHNAME', 'pg_rage_terminator_stop'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION pg_rage_terminator_stats_reset() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_rage_terminator_launch() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_rage_terminator_stop() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_rage_terminator_fire(int4) FROM PUBLIC;
+
+-- Victims' PIDs and client addresses are only for roles that may see all
+-- of pg_stat_activity
+REVOKE ALL ON FUNCTION pg_rage_terminator_stats() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_rage_terminator_history() FROM PUBLIC;
+REVOKE ALL ON pg_rage_terminator_stats FROM PUBLIC;
+REVOKE ALL ON pg_rage_terminator_history FROM PUBLIC;
+
+-- pg_read_all_stats exists since PostgreSQL 10
+DO $$
+BEGIN
+    IF EXISTS (SELECT 1 FROM pg_roles WHERE rolname = 'pg_read_all_stats') THEN
+        GRANT EXECUTE ON FUNCTION pg_rage_terminator_stats() TO pg_read_all_stats;
+        GRANT EXECUTE ON FUNCTION pg_rage_terminator_history() TO pg_read_all_stats;
+        GRANT SELECT ON pg_rage_terminator_stats TO pg_read_all_stats;
+        GRANT SELECT ON pg_rage_terminator_history TO pg_read_all_stats;
+    END IF;
+END
+$$;
@@ -13,17 +13,68 @@
 
 /* Some general headers for custom bgworker facility */
 #include "postgres.h"
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
 #include "fmgr.h"
+#include "libpq/pqcomm.h"
+#include "miscadmin.h"
 #include "access/xact.h"
-#include "lib/stringinfo.h"
+#include "access/xlog.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
 #include "pgstat.h"
 #include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/binaryheap.h"
+#include "pgtime.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/varlena.h"
+#endif
+
+/*
+ * The native scan walks the local copy of the backend status array.
+ * PG17 renamed the accessor, keep a single name for it here.
+ */
+#if PG_VERSION_NUM >= 170000
+#define rage_fetch_local_beentry(idx) pgstat_get_local_beentry_by_index(idx)
+#else
+#define rage_fetch_local_beentry(idx) pgstat_fetch_stat_local_beentry(idx)
+#endif
+
+/*
+ * Phases of a round are reported as wait events, so they show up in
+ * pg_stat_activity. Wait events of extensions have names since PG17,
+ * before that all phases are the generic "Extension" event.
+ */
+#if PG_VERSION_NUM >= 100000
+#define rage_wait_start(event) pgstat_report_wait_start(event)
+#define rage_wait_end() pgstat_report_wait_end()
+#else
+#define rage_wait_start(event) ((void) 0)
+#define rage_wait_end() ((void) 0)
+#endif
 
 /* Allow load of this module in shared libs */
 PG_MODULE_MAGIC;
@@ -31,24 +82,568 @@ PG_MODULE_MAGIC;
 /* Entry point of library loading */
 void _PG_init(void);
 
+PG_FUNCTION_INFO_V1(pg_rage_terminator_stats);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_workers);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_stats_reset);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_stats_dropped);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_history);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_fire);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_launch);
+PG_FUNCTION_INFO_V1(pg_rage_terminator_stop);
+
 /* Signal handling */
 static volatile sig_atomic_t got_sigterm = false;
 static volatile sig_atomic_t got_sighup = false;
 
+/* Backend scan methods */
+typedef enum
+{
+	RAGE_SCAN_SQL,				/* query pg_stat_activity through SPI */
+	RAGE_SCAN_NATIVE			/* walk the backend status array directly */
+} RageScanMode;
+
+static const struct config_enum_entry scan_mode_options[] = {
+	{"sql", RAGE_SCAN_SQL, false},
+	{"native", RAGE_SCAN_NATIVE, false},
+	{NULL, 0, false}
+};
+
+/* What is done to a victim */
+typedef enum
+{
+	RAGE_KILL_TERMINATE,		/* pg_terminate_backend() */
+	RAGE_KILL_CANCEL,			/* pg_cancel_backend() */
+	RAGE_KILL_ESCALATE			/* cancel, terminate if still busy */
+} RageKillMode;
+
+static const struct config_enum_entry kill_mode_options[] = {
+	{"terminate", RAGE_KILL_TERMINATE, false},
+	{"cancel", RAGE_KILL_CANCEL, false},
+#if PG_VERSION_NUM >= 100000
+	{"escalate", RAGE_KILL_ESCALATE, false},
+#endif
+	{NULL, 0, false}
+};
+
+/* What the workers do on a standby */
+typedef enum
+{
+	RAGE_STANDBY_ON,			/* the same as on a primary */
+	RAGE_STANDBY_OFF,			/* nothing, rounds are skipped */
+	RAGE_STANDBY_READ_ONLY		/* native scan of client backends only */
+} RageStandbyMode;
+
+static const struct config_enum_entry standby_mode_options[] = {
+	{"on", RAGE_STANDBY_ON, false},
+	{"off", RAGE_STANDBY_OFF, false},
+	{"read_only", RAGE_STANDBY_READ_ONLY, false},
+	{NULL, 0, false}
+};
+
+/* How victims are picked out of the candidates */
+typedef enum
+{
+	RAGE_SELECT_RANDOM,			/* every candidate has the same chance */
+	RAGE_SELECT_OLDEST_QUERY,	/* longest running queries first */
+	RAGE_SELECT_OLDEST_XACT		/* longest running transactions first */
+} RageSelection;
+
+static const struct config_enum_entry selection_options[] = {
+	{"random", RAGE_SELECT_RANDOM, false},
+	{"oldest_query", RAGE_SELECT_OLDEST_QUERY, false},
+	{"oldest_xact", RAGE_SELECT_OLDEST_XACT, false},
+	{NULL, 0, false}
+};
+
+/* Groups of candidates that are hit together */
+typedef enum
+{
+	RAGE_COHORT_NONE,			/* every candidate on its own */
+	RAGE_COHORT_CLIENT_ADDR,	/* all sessions of a client address */
+	RAGE_COHORT_APPLICATION_NAME	/* all sessions of an application */
+} RageCohort;
+
+static const struct config_enum_entry cohort_options[] = {
+	{"none", RAGE_COHORT_NONE, false},
+	{"client_addr", RAGE_COHORT_CLIENT_ADDR, false},
+	{"application_name", RAGE_COHORT_APPLICATION_NAME, false},
+	{NULL, 0, false}
+};
+
+/* Logging of terminated backends */
+typedef enum
+{
+	RAGE_LOG_ALL,				/* one line per terminated backend */
+	RAGE_LOG_SUMMARY,			/* one line per round */
+	RAGE_LOG_SAMPLED			/* summary plus rate limited details */
+} RageLogMode;
+
+static const struct config_enum_entry log_kills_options[] = {
+	{"all", RAGE_LOG_ALL, false},
+	{"summary", RAGE_LOG_SUMMARY, false},
+	{"sampled", RAGE_LOG_SAMPLED, false},
+	{NULL, 0, false}
+};
+
 /* GUC variables */
 static int chance = 10;
-static int interval = 5;
+static int interval = 5000;
+static int reconnect_target = 0;
+static int nworkers = 1;
+static int max_stats = 1000;
+static int history_size = 1000;
+static int log_kills = RAGE_LOG_ALL;
+static int log_rate_limit = 10;
+static int seed = 0;
+static int trigger_active_backends = 0;
+static int trigger_xact_age = 0;
+static int trigger_connection_rate = 0;
+static char *filter_databases_str = NULL;
+static char *filter_exclude_databases_str = NULL;
+static char *filter_roles_str = NULL;
+static char *filter_exclude_roles_str = NULL;
+static char *filter_application_names_str = NULL;
+static char *filter_client_addrs_str = NULL;
+static char *filter_states_str = NULL;
+static char *schedule_str = NULL;
+static char *chance_map_str = NULL;
+static int kill_mode = RAGE_KILL_TERMINATE;
+static int selection = RAGE_SELECT_RANDOM;
+static int standby_mode = RAGE_STANDBY_ON;
+static bool dry_run = false;
+static bool spare_critical = false;
+static int cohort = RAGE_COHORT_NONE;
+static int max_kills_per_round = 0;
+static int max_kills_per_minute = 0;
+static int storm_window = 0;
+static int storm_jitter = 0;
+static int escalate_timeout = 1000;
+static int scan_mode = RAGE_SCAN_NATIVE;
+static char *database = "";
 
 /* Worker name */
 static char *worker_name = "pg_rage_terminator";
 
-#if PG_VERSION_NUM >= 90500
+/*
+ * Shared state of the terminator workers. Every worker owns the backends
+ * whose PID modulo the number of workers equals its index, so that no
+ * backend is handled by two workers within one round. Each worker
+ * registers itself in its slot, protected by the spinlock.
+ */
+typedef struct RageWorkerSlot
+{
+	pid_t		pid;			/* 0 if the worker is not running */
+	Latch	   *latch;			/* latch of the running worker */
+	bool		paused;			/* interval is 0, no rounds are done */
+	int			fire_chance;	/* chance of a fired round, -1 for the setting */
+
+	/*
+	 * Rounds asked for by pg_rage_terminator_fire(), and the ones done.
+	 * Requested under the spinlock, together with their chance: a request
+	 * with another chance waits until the pending ones have been done.
+	 */
+	pg_atomic_uint64 fire_requested;
+	pg_atomic_uint64 fire_done;
+
+	/* Round counters, only written by the owning worker */
+	pg_atomic_uint64 rounds;	/* kill rounds done */
+	pg_atomic_uint64 kills;		/* backends terminated */
+	pg_atomic_uint64 cancels;	/* queries canceled */
+	pg_atomic_uint64 dry_run_kills;	/* kills in dry run mode */
+	pg_atomic_uint64 dry_run_cancels;	/* cancels in dry run mode */
+	pg_atomic_uint64 round_time;	/* total time spent in rounds (us) */
+	pg_atomic_uint64 last_round_time;	/* duration of last round (us) */
+	pg_atomic_uint64 cpu_time;	/* CPU time used by rounds (us) */
+	pg_atomic_uint64 snapshot_time;	/* time reading backend status (us) */
+	pg_atomic_uint64 signal_time;	/* time picking and signaling (us) */
+	pg_atomic_uint64 effective_interval;	/* interval after backoff (ms) */
+	pg_atomic_uint64 reconnect_time;	/* last mean reconnect time (us) */
+	pg_atomic_uint64 skipped;	/* rounds skipped, no trigger fired */
+} RageWorkerSlot;
+
+/*
+ * Token bucket of the victims allowed per minute, refilled continuously
+ * with max_kills_per_minute tokens per minute.
+ */
+typedef struct RageBudget
+{
+	double		tokens;
+	TimestampTz refill_time;	/* 0 if never refilled */
+} RageBudget;
+
+typedef struct RageSharedState
+{
+	slock_t		mutex;			/* protects worker pids and the budget */
+	RageBudget	budget;			/* kill budget shared by all workers */
+	LWLock	   *lock;			/* protects the stats hash table */
+	pg_atomic_uint64 stats_dropped;	/* kills not counted, table full */
+	pg_atomic_uint64 history_next;	/* number of kills ever recorded */
+	int			nworkers;
+	RageWorkerSlot workers[FLEXIBLE_ARRAY_MEMBER];
+} RageSharedState;
+
+/*
+ * Kill statistics are kept in a shared hash table keyed by database,
+ * role and client address. Entries are only added under the exclusive
+ * lock; counters of existing entries are bumped under the shared lock.
+ */
+#define RAGE_ADDR_LEN	64
+
+typedef struct RageStatsKey
+{
+	Oid			datid;
+	Oid			userid;
+	char		client_addr[RAGE_ADDR_LEN];	/* empty if none */
+} RageStatsKey;
+
+typedef struct RageStatsEntry
+{
+	RageStatsKey key;			/* hash key of entry - MUST BE FIRST */
+	pg_atomic_uint64 kills;
+	pg_atomic_uint64 last_kill;	/* TimestampTz of the last kill */
+	pg_atomic_uint64 dry_run_kills;	/* kills in dry run mode */
+} RageStatsEntry;
+
+static HTAB *rage_stats = NULL;
+
+/* Shared memory state, NULL unless loaded in shared_preload_libraries */
+static RageSharedState *rage_shared = NULL;
+
+/*
+ * Index of this worker, in the range [0, worker_shards). Static workers
+ * split the backends into nworkers shards, a worker launched through
+ * pg_rage_terminator_launch() handles all of them.
+ */
+static int worker_index = 0;
+static int worker_shards = 1;
+
+/* Main argument of a worker launched through pg_rage_terminator_launch() */
+#define RAGE_DYNAMIC_WORKER		(-1)
+
+/* State of the victim selection generator, and the seed it came from */
+static uint64 prng_state = 0;
+static int prng_seed = 0;
+
+/*
+ * Client address of a candidate. Only the bits of the address are kept,
+ * formatting is deferred until a candidate has been terminated.
+ */
+typedef struct RageAddr
+{
+	uint8		family;			/* AF_INET, AF_INET6 or 0 if none */
+	uint8		addr[16];
+} RageAddr;
+
+/* Backend that might be picked as a victim */
+typedef struct RageCandidate
+{
+	int			pid;
+	Oid			datid;
+	Oid			userid;
+	RageAddr	client_addr;
+	BackendState state;
+	TimestampTz query_start;
+	TimestampTz xact_start;
+	TimestampTz proc_start;		/* backend start, tells a recycled PID */
+	int64		query_id;		/* 0 if unknown */
+	int			chance;			/* chance from the chance map */
+	const char *appname;		/* valid for the current round only */
+	const char *who;			/* "database/role" of the SQL scan, or NULL */
+} RageCandidate;
+
+/* Database and role of a victim in the log, by name or by OID */
+#define RAGE_WHO_LEN	(NAMEDATALEN * 2)
+
+/*
+ * Kill history, a ring buffer of the last history_size victims in shared
+ * memory. Writers claim an entry by bumping history_next, so no lock is
+ * needed. Every entry has its own change counter, odd while the entry is
+ * being written: readers copy an entry and use the copy only if the
+ * counter is even and unchanged, and the copy has the sequence number
+ * they expect. A writer claims an entry before it bumps the counter, so
+ * until then the entry still holds the kill of the previous lap.
+ */
+typedef struct RageKill
+{
+	uint64		seq;			/* value of history_next claimed for it */
+	int			pid;
+	TimestampTz kill_time;
+	Oid			datid;
+	Oid			userid;
+	RageAddr	client_addr;
+	int64		query_id;
+	BackendState state;
+	bool		canceled;		/* query canceled, not terminated */
+	bool		dry_run;		/* not signaled, dry run mode */
+} RageKill;
+
+typedef struct RageHistoryEntry
+{
+	pg_atomic_uint32 changecount;
+	RageKill	kill;
+} RageHistoryEntry;
+
+static RageHistoryEntry *rage_history = NULL;
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Victims whose query has been canceled in escalate mode. They are kept
+ * in an open addressing hash table keyed by PID until their deadline
+ * has passed; those still running the canceled query are terminated.
+ */
+typedef struct RagePending
+{
+	int			pid;			/* hash key */
+	char		status;			/* hash status */
+	TimestampTz deadline;		/* check the victim again at this time */
+	TimestampTz query_start;	/* start of the canceled query */
+	Oid			datid;
+	Oid			userid;
+	RageAddr	client_addr;
+	char		who[RAGE_WHO_LEN];	/* database and role for the log */
+} RagePending;
+
+/* Same finalizer as murmurhash32(), PIDs are not random enough */
+static inline uint32
+pg_rage_terminator_hash_pid(int pid)
+{
+	uint32		h = (uint32) pid;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+#define SH_PREFIX rage_pending
+#define SH_ELEMENT_TYPE RagePending
+#define SH_KEY_TYPE int
+#define SH_KEY pid
+#define SH_HASH_KEY(tb, key) pg_rage_terminator_hash_pid(key)
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static rage_pending_hash *pending = NULL;
+
+/* Earliest deadline in the pending table, 0 if it is empty */
+static TimestampTz pending_next = 0;
+
+/*
+ * Entries of the status array by PID, built once per snapshot so the
+ * victims of a storm are checked in constant time each.
+ */
+typedef struct RageLive
+{
+	int			pid;			/* hash key */
+	char		status;			/* hash status */
+	PgBackendStatus *beentry;	/* entry in the local snapshot */
+} RageLive;
+
+#define SH_PREFIX rage_live
+#define SH_ELEMENT_TYPE RageLive
+#define SH_KEY_TYPE int
+#define SH_KEY pid
+#define SH_HASH_KEY(tb, key) pg_rage_terminator_hash_pid(key)
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static rage_live_hash *live = NULL;
+#endif
+
+/*
+ * Targeting filters. The filter settings are compiled on every reload,
+ * database and role names are resolved to OIDs once, so matching a
+ * candidate only needs integer compares.
+ */
+typedef struct RageOidFilter
+{
+	bool		active;			/* false if the setting is empty */
+	int			noids;
+	Oid		   *oids;
+} RageOidFilter;
+
+static RageOidFilter filter_databases;
+static RageOidFilter filter_exclude_databases;
+static RageOidFilter filter_roles;
+static RageOidFilter filter_exclude_roles;
+static List *filter_application_names = NIL;
+
+/* Client addresses, compared in their compact form */
+typedef struct RageAddrFilter
+{
+	bool		active;			/* false if the setting is empty */
+	int			naddrs;
+	RageAddr   *addrs;
+} RageAddrFilter;
+
+static RageAddrFilter filter_client_addrs;
+
+/*
+ * Everything derived from the settings lives in config_context, which is
+ * reset on every reload. Whatever a round allocates goes to round_context,
+ * reset after every round, so a long running worker stays flat.
+ */
+static MemoryContext config_context = NULL;
+static MemoryContext round_context = NULL;
+static int	filter_states = 0;	/* bitmask of BackendState, 0 for all */
+
+/*
+ * Time window of the schedule, in minutes since local midnight. Windows
+ * crossing midnight are split in two, and the table is sorted by start,
+ * so the window of a round and the start of the next one are found with
+ * a single pass.
+ */
+typedef struct RageWindow
+{
+	int			start;			/* first minute of the window */
+	int			end;			/* first minute after the window */
+	int			chance;
+	Oid			datid;			/* InvalidOid for all databases */
+} RageWindow;
+
+#define RAGE_MINUTES_PER_DAY	(24 * 60)
+
+static RageWindow *schedule = NULL;
+static int	nwindows = 0;
+
+/* Chance and database of the current round, from the schedule */
+static int	round_chance = 0;
+static Oid	round_datid = InvalidOid;
+
+/*
+ * Chance overrides per database and per role, keyed by OID. Role entries
+ * take precedence over database entries.
+ */
+typedef struct RageChanceEntry
+{
+	Oid			oid;			/* hash key - MUST BE FIRST */
+	int			chance;
+} RageChanceEntry;
+
+static HTAB *chance_map_databases = NULL;
+static HTAB *chance_map_roles = NULL;
+static bool chance_map_active = false;
+
+/* Names of the backend states, as shown in pg_stat_activity */
+static const struct
+{
+	const char *name;
+	BackendState state;
+}			state_names[] =
+{
+	{"idle", STATE_IDLE},
+	{"active", STATE_RUNNING},
+	{"idle in transaction", STATE_IDLEINTRANSACTION},
+	{"fastpath function call", STATE_FASTPATH},
+	{"idle in transaction (aborted)", STATE_IDLEINTRANSACTION_ABORTED},
+	{"disabled", STATE_DISABLED},
+	{NULL, STATE_UNDEFINED}
+};
+
+/*
+ * Time of the current round spent reading the backend status, either
+ * copying the status array or with an open transaction and snapshot.
+ */
+static instr_time round_snapshot_time;
+
+/* Time of the current round spent picking and signaling victims */
+static instr_time round_signal_time;
+
+#if PG_VERSION_NUM >= 100000
+/* Wait events of the sleep between rounds, the scan and the signaling */
+static uint32 wait_event_sleep = PG_WAIT_EXTENSION;
+static uint32 wait_event_scan = PG_WAIT_EXTENSION;
+static uint32 wait_event_signal = PG_WAIT_EXTENSION;
+#endif
+
+/* Last evaluation of the connection rate trigger */
+static TimestampTz trigger_check_time = 0;
+
+/* Token bucket for sampled kill logging */
+static double log_tokens = 0;
+static TimestampTz log_tokens_time = 0;
+
+/* Kills of the current round not logged individually */
+static int log_suppressed = 0;
+
+/* Queries canceled in the current round */
+static int round_cancels = 0;
+
+/* Victims signaled in the current round */
+static int round_victims = 0;
+
+/* The current round runs on a standby in read_only mode */
+static bool round_read_only = false;
+
+/* The current round has been fired from SQL, its victims are not paced */
+static bool round_fired = false;
+
+/*
+ * Interval between rounds, stretched by the reconnect controller while
+ * terminated clients take longer than reconnect_target to come back.
+ */
+static int	round_interval = 0;
+
+/* Longest backoff, as a multiple of the interval */
+#define RAGE_MAX_BACKOFF		16
+
+/*
+ * Terminated victims whose clients are watched for reconnecting. Only
+ * the first ones of a round are sampled, which bounds the cost of the
+ * measurement.
+ */
+#define RAGE_RECONNECT_SAMPLES	64
+
+typedef struct RageReconnect
+{
+	Oid			datid;
+	Oid			userid;
+	RageAddr	client_addr;
+	TimestampTz kill_time;
+} RageReconnect;
+
+static RageReconnect reconnects[RAGE_RECONNECT_SAMPLES];
+static int	nreconnects = 0;
+
+/* Kill budget of a worker running without shared memory */
+static RageBudget local_budget = {0, 0};
+
+/*
+ * Victims of a round spread over storm_window, in the order they are due.
+ * The queue is filled by a round and drained by the latch loop, the next
+ * round only starts once it is empty.
+ */
+typedef struct RagePaced
+{
+	TimestampTz due;
+	RageCandidate cand;			/* appname is not kept, who is copied */
+} RagePaced;
+
+static RagePaced *paced = NULL;
+static int	npaced = 0;			/* victims in the queue */
+static int	paced_next = 0;		/* index of the next victim due */
+static int	maxpaced = 0;
+static int	paced_killed = 0;	/* terminated so far by the queue */
+
+/* Saved hook values in case of unload */
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
 /*
  * Forward declaration for main routine. Makes compiler
  * happy (-Wunused-function, __attribute__((noreturn)))
  */
 void pg_rage_terminator_main(Datum main_arg) pg_attribute_noreturn();
-#endif
 
 static void
 pg_rage_terminator_sigterm(SIGNAL_ARGS)
@@ -70,169 +665,2862 @@ pg_rage_terminator_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+/*
+ * Candidate query of the SQL scan. The number of workers and the index
+ * of this worker are passed in as $1 and $2, so the statement is planned
+ * only once for the lifetime of the worker.
+ */
+static const char *kill_query = "SELECT "
+	"pid, datid, usesysid, host(client_addr), state, application_name, "
+	"query_start, xact_start, backend_start, datname, usename"
+#if PG_VERSION_NUM >= 140000
+	", query_id"
+#endif
+	" FROM pg_stat_activity "
+	"WHERE client_port IS NOT NULL "
+	"AND pid % $1 = $2 ";
+
+/* Saved plan of the candidate query, prepared on first use */
+static SPIPlanPtr kill_plan = NULL;
+
 static void
-pg_rage_terminator_build_query(StringInfoData *buf)
+pg_rage_terminator_prepare_query(void)
 {
-    appendStringInfo(buf, "SELECT "
-               "pid, pg_terminate_backend(pid) as status, "
-               "usename, datname, client_addr::text "
-               "FROM pg_stat_activity "
-               "WHERE client_port IS NOT NULL "
-               "AND ((random() * 100)::int < %d) ",
-                     chance);
-    elog(DEBUG1, "Kill query is: %s", buf->data);
+	Oid			argtypes[2] = {INT4OID, INT4OID};
+
+	kill_plan = SPI_prepare(kill_query, 2, argtypes);
+	if (kill_plan == NULL)
+		elog(FATAL, "could not prepare kill query: %s",
+			 SPI_result_code_string(SPI_result));
+
+	/* Keep the plan around across transactions */
+	if (SPI_keepplan(kill_plan))
+		elog(FATAL, "could not save kill query plan");
+
+	elog(DEBUG1, "Kill query is: %s", kill_query);
 }
 
-void
-pg_rage_terminator_main(Datum main_arg)
+/*
+ * xorshift64* generator for the victim selection. It is seeded from
+ * pg_rage_terminator.seed, so a kill round can be replayed.
+ */
+static uint64
+pg_rage_terminator_random(void)
 {
-	StringInfoData buf;
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+	return prng_state * UINT64CONST(0x2545F4914F6CDD1D);
+}
 
-	/* Register functions for SIGTERM/SIGHUP management */
-	pqsignal(SIGHUP, pg_rage_terminator_sighup);
-	pqsignal(SIGTERM, pg_rage_terminator_sigterm);
+/*
+ * Random double in the range (0, 1].
+ */
+static double
+pg_rage_terminator_random_double(void)
+{
+	return ((pg_rage_terminator_random() >> 11) + 1) *
+		(1.0 / (UINT64CONST(1) << 53));
+}
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+/*
+ * Seed the generator. Every worker gets its own sequence, a seed of 0
+ * asks for a different sequence on every start.
+ */
+static void
+pg_rage_terminator_seed(void)
+{
+	uint64		z;
 
-	/* Connect to a database */
-#if PG_VERSION_NUM >= 110000
-	BackgroundWorkerInitializeConnection("postgres", NULL, BGWORKER_SHMEM_ACCESS|BGWORKER_BACKEND_DATABASE_CONNECTION);
-#else
-	BackgroundWorkerInitializeConnection("postgres", NULL);
-#endif
+	if (seed != 0)
+		z = (uint64) seed;
+	else
+		z = (uint64) GetCurrentTimestamp() ^ ((uint64) MyProcPid << 32);
 
-	/* Build query for process */
-	initStringInfo(&buf);
-	pg_rage_terminator_build_query(&buf);
+	/* splitmix64 step, so that similar seeds give unrelated sequences */
+	z += UINT64CONST(0x9E3779B97F4A7C15) * (worker_index + 1);
+	z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	z ^= z >> 31;
 
-	while (!got_sigterm)
-	{
-		int rc = 0;
-        int ret, i;
-        int sleep_interval;
+	/* xorshift must not start from 0 */
+	prng_state = z ? z : UINT64CONST(0x9E3779B97F4A7C15);
+	prng_seed = seed;
+}
 
-        if (0 == interval)
-            sleep_interval = 10;
-        else
-            sleep_interval = interval;
+/*
+ * Number of candidates to skip before the next victim. With a chance
+ * of p per candidate the gaps between victims are geometrically
+ * distributed, so only one random number per victim is needed.
+ */
+static int
+pg_rage_terminator_skip(int kill_chance)
+{
+	double		skip;
 
-        /* Wait necessary amount of time */
-        rc = WaitLatch(&MyProc->procLatch,
-                       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-                       sleep_interval * 1000L
-#if PG_VERSION_NUM >= 100000
-					   , PG_WAIT_EXTENSION
-#endif
-			);
-        ResetLatch(&MyProc->procLatch);
+	skip = floor(log(pg_rage_terminator_random_double()) /
+				 log1p(-kill_chance / 100.0));
+	return skip < INT_MAX ? (int) skip : INT_MAX;
+}
 
-		/* Emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
+/*
+ * Send a signal to a client backend, the same way pg_signal_backend()
+ * does. We run as superuser, so no permission checks are needed.
+ * Returns true if the signal has been sent. In dry run mode, the victim
+ * is looked up the same way, but not signaled.
+ */
+static bool
+pg_rage_terminator_signal(int pid, int sig)
+{
+	/* Backend has gone away since the scan, nothing to do */
+	if (BackendPidGetProc(pid) == NULL)
+		return false;
 
-		/* Process signals */
-		if (got_sighup)
-		{
-			int old_chance;
-			/* Save old value of kill chance */
-			old_chance = chance;
+	if (dry_run)
+		return true;
 
-			/* Process config file */
-			ProcessConfigFile(PGC_SIGHUP);
-			got_sighup = false;
-			ereport(LOG, (errmsg("bgworker pg_rage_terminator signal: processed SIGHUP")));
+	/* Signal the whole process group if we can, like the backend does */
+#ifdef HAVE_SETSID
+	if (kill(-pid, sig))
+#else
+	if (kill(pid, sig))
+#endif
+	{
+		ereport(WARNING,
+				(errmsg("could not send signal to process %d: %m", pid)));
+		return false;
+	}
 
-			/* Rebuild query if necessary */
-			if (old_chance != chance)
-			{
-				resetStringInfo(&buf);
-				initStringInfo(&buf);
-				pg_rage_terminator_build_query(&buf);
-			}
-		}
+	return true;
+}
 
-		if (got_sigterm)
-		{
-			/* Simply exit */
-			ereport(LOG, (errmsg("bgworker pg_rage_terminator signal: processed SIGTERM")));
-			proc_exit(0);
-		}
+/*
+ * Convert a socket address into the compact form kept per candidate.
+ */
+static void
+pg_rage_terminator_addr_from_sockaddr(RageAddr *addr, const SockAddr *sockaddr)
+{
+	memset(addr, 0, sizeof(RageAddr));
 
-        /*
-         * If interval is 0 we should not do anything.
-         * This has to be done after sighup and sigterm handling.
-         */
-        if (0 == interval)
-        {
-            elog(LOG, "Nothing to do, sleep zzzzZZZZ");
-            continue;
-        }
+	if (sockaddr->addr.ss_family == AF_INET)
+	{
+		addr->family = AF_INET;
+		memcpy(addr->addr,
+			   &((const struct sockaddr_in *) &sockaddr->addr)->sin_addr, 4);
+	}
+	else if (sockaddr->addr.ss_family == AF_INET6)
+	{
+		addr->family = AF_INET6;
+		memcpy(addr->addr,
+			   &((const struct sockaddr_in6 *) &sockaddr->addr)->sin6_addr, 16);
+	}
+}
 
+/*
+ * Convert the output of host(client_addr) into the compact form.
+ */
+static void
+pg_rage_terminator_addr_from_string(RageAddr *addr, const char *str)
+{
+	memset(addr, 0, sizeof(RageAddr));
 
-		/* Process idle connection kill */
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
-		pgstat_report_activity(STATE_RUNNING, buf.data);
-
-		/* Statement start time */
-		SetCurrentStatementStartTimestamp();
-
-		/* Execute query */
-		ret = SPI_execute(buf.data, false, 0);
-
-		/* Some error handling */
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "Error when trying to rage");
-
-		/* Do some processing and log stuff disconnected */
-		for (i = 0; i < SPI_processed; i++)
-		{
-			int32 pidValue;
-			bool isnull;
-			char *datname = NULL;
-			char *usename = NULL;
-			char *client_addr = NULL;
-
-			/* Fetch values */
-			pidValue = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
-												   SPI_tuptable->tupdesc,
-												   1, &isnull));
-			usename = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-													SPI_tuptable->tupdesc,
-													3, &isnull));
-			datname = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-													SPI_tuptable->tupdesc,
-													4, &isnull));
-            client_addr = DatumGetCString(SPI_getbinval(SPI_tuptable->vals[i],
-                                                        SPI_tuptable->tupdesc,
-                                                        5, &isnull));
-
-			/* Log what has been disconnected */
-			elog(LOG, "Rage terminated connection with PID %d %s/%s/%s",
-				 pidValue, datname ? datname : "none",
-				 usename ? usename : "none",
-				 client_addr ? client_addr : "none");
-		}
-
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_activity(STATE_IDLE, NULL);
-	}
+	if (str == NULL)
+		return;
 
-	/* No problems, so clean exit */
-	proc_exit(0);
+	if (inet_pton(AF_INET, str, addr->addr) == 1)
+		addr->family = AF_INET;
+	else if (inet_pton(AF_INET6, str, addr->addr) == 1)
+		addr->family = AF_INET6;
 }
 
+/*
+ * Format a client address the same way host(pg_stat_activity.client_addr)
+ * does. Unix socket and missing addresses result in an empty string.
+ */
 static void
-pg_rage_terminator_load_params(void)
+pg_rage_terminator_format_addr(const RageAddr *addr, char *buf, size_t len)
 {
-	/*
-	 * Kill backends with a chance of <chance>.
-     * Look every <interval> seconds for new targets.
+	if (addr->family == 0 ||
+		inet_ntop(addr->family, addr->addr, buf, len) == NULL)
+		buf[0] = '\0';
+}
+
+/*
+ * Decide whether a terminated backend gets its own log line. In sampled
+ * mode, lines are taken from a token bucket refilled with
+ * log_rate_limit tokens per second.
+ */
+static bool
+pg_rage_terminator_log_victim(void)
+{
+	TimestampTz now;
+	long		secs;
+	int			usecs;
+
+	if (log_kills == RAGE_LOG_ALL)
+		return true;
+
+	if (log_kills == RAGE_LOG_SAMPLED)
+	{
+		now = GetCurrentTimestamp();
+		if (log_tokens_time == 0)
+			log_tokens = log_rate_limit;
+		else
+		{
+			TimestampDifference(log_tokens_time, now, &secs, &usecs);
+			log_tokens += (secs + usecs / 1000000.0) * log_rate_limit;
+			if (log_tokens > log_rate_limit)
+				log_tokens = log_rate_limit;
+		}
+		log_tokens_time = now;
+
+		if (log_tokens >= 1)
+		{
+			log_tokens -= 1;
+			return true;
+		}
+	}
+
+	log_suppressed++;
+	return false;
+}
+
+/*
+ * Refill a kill budget up to its capacity. Called with the budget locked.
+ */
+static void
+pg_rage_terminator_refill_budget(RageBudget *budget, TimestampTz now)
+{
+	long		secs;
+	int			usecs;
+
+	if (budget->refill_time == 0)
+		budget->tokens = max_kills_per_minute;
+	else
+	{
+		TimestampDifference(budget->refill_time, now, &secs, &usecs);
+		budget->tokens += (secs + usecs / 1000000.0) * max_kills_per_minute / 60.0;
+		if (budget->tokens > max_kills_per_minute)
+			budget->tokens = max_kills_per_minute;
+	}
+	budget->refill_time = Max(budget->refill_time, now);
+}
+
+/*
+ * Take up to wanted victims out of the kill budget, limited by
+ * max_kills_per_round for the current round and by the per minute bucket
+ * shared by all workers. Returns the number of victims granted.
+ */
+static int
+pg_rage_terminator_take_budget(int wanted)
+{
+	RageBudget *budget;
+	TimestampTz now;
+	int			granted;
+
+	if (max_kills_per_round > 0)
+		wanted = Min(wanted, max_kills_per_round - round_victims);
+	if (wanted <= 0)
+		return 0;
+
+	if (max_kills_per_minute == 0)
+	{
+		round_victims += wanted;
+		return wanted;
+	}
+
+	now = GetCurrentTimestamp();
+	if (rage_shared != NULL)
+	{
+		budget = &rage_shared->budget;
+		SpinLockAcquire(&rage_shared->mutex);
+	}
+	else
+		budget = &local_budget;
+
+	pg_rage_terminator_refill_budget(budget, now);
+	granted = Min(wanted, (int) budget->tokens);
+	budget->tokens -= granted;
+
+	if (rage_shared != NULL)
+		SpinLockRelease(&rage_shared->mutex);
+
+	round_victims += granted;
+	return granted;
+}
+
+/*
+ * Check whether the per minute kill budget has room for a victim, so
+ * rounds that could not kill anyone are not started at all.
+ */
+static bool
+pg_rage_terminator_budget_left(void)
+{
+	RageBudget *budget;
+	TimestampTz now;
+	bool		left;
+
+	if (max_kills_per_minute == 0)
+		return true;
+
+	now = GetCurrentTimestamp();
+	if (rage_shared != NULL)
+	{
+		budget = &rage_shared->budget;
+		SpinLockAcquire(&rage_shared->mutex);
+	}
+	else
+		budget = &local_budget;
+
+	pg_rage_terminator_refill_budget(budget, now);
+	left = budget->tokens >= 1;
+
+	if (rage_shared != NULL)
+		SpinLockRelease(&rage_shared->mutex);
+
+	return left;
+}
+
+/*
+ * Log the summary line of a round, unless every kill has been logged.
+ */
+static void
+pg_rage_terminator_log_round(int killed)
+{
+	if (log_kills == RAGE_LOG_ALL || (killed == 0 && round_cancels == 0))
+		return;
+
+	if (log_suppressed > 0 && log_kills == RAGE_LOG_SAMPLED)
+		elog(LOG, "Rage terminated %d connections and canceled %d queries, "
+			 "%d of them not logged%s",
+			 killed, round_cancels, log_suppressed,
+			 dry_run ? " (dry run)" : "");
+	else
+		elog(LOG, "Rage terminated %d connections and canceled %d queries%s",
+			 killed, round_cancels, dry_run ? " (dry run)" : "");
+}
+
+/*
+ * Count a terminated backend in the shared statistics.
+ */
+static void
+pg_rage_terminator_count_kill(Oid datid, Oid userid, const char *client_addr)
+{
+	RageStatsKey key;
+	RageStatsEntry *entry;
+
+	if (rage_shared == NULL)
+		return;
+
+	/* Keys are hashed as blobs, so clear the padding */
+	memset(&key, 0, sizeof(key));
+	key.datid = datid;
+	key.userid = userid;
+	strlcpy(key.client_addr, client_addr, sizeof(key.client_addr));
+
+	LWLockAcquire(rage_shared->lock, LW_SHARED);
+	entry = (RageStatsEntry *) hash_search(rage_stats, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		/*
+		 * Need the exclusive lock to add a new entry. Another worker may
+		 * have added it while no lock was held, look it up again.
+		 */
+		LWLockRelease(rage_shared->lock);
+		LWLockAcquire(rage_shared->lock, LW_EXCLUSIVE);
+
+		entry = (RageStatsEntry *) hash_search(rage_stats, &key,
+											   HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			if (hash_get_num_entries(rage_stats) >= max_stats)
+			{
+				LWLockRelease(rage_shared->lock);
+				pg_atomic_fetch_add_u64(&rage_shared->stats_dropped, 1);
+				return;
+			}
+
+			entry = (RageStatsEntry *) hash_search(rage_stats, &key,
+												   HASH_ENTER, NULL);
+			pg_atomic_init_u64(&entry->kills, 0);
+			pg_atomic_init_u64(&entry->last_kill, 0);
+			pg_atomic_init_u64(&entry->dry_run_kills, 0);
+		}
+	}
+
+	/* Kills of a dry run are kept apart, last_kill is for real ones */
+	if (dry_run)
+		pg_atomic_fetch_add_u64(&entry->dry_run_kills, 1);
+	else
+	{
+		pg_atomic_fetch_add_u64(&entry->kills, 1);
+		pg_atomic_write_u64(&entry->last_kill, (uint64) GetCurrentTimestamp());
+	}
+
+	LWLockRelease(rage_shared->lock);
+}
+
+/*
+ * CPU time used by this process so far, in microseconds.
+ */
+static uint64
+pg_rage_terminator_cpu_time(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+	return (uint64) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * Count terminated backends of this worker, apart from the real ones in
+ * dry run mode.
+ */
+static void
+pg_rage_terminator_count_kills(int kills)
+{
+	RageWorkerSlot *slot;
+
+	if (rage_shared == NULL || kills == 0)
+		return;
+
+	slot = &rage_shared->workers[worker_index];
+	pg_atomic_fetch_add_u64(dry_run ? &slot->dry_run_kills : &slot->kills,
+							kills);
+}
+
+/*
+ * Account a finished kill round of this worker.
+ */
+static void
+pg_rage_terminator_count_round(int kills, instr_time duration, uint64 cpu_time)
+{
+	RageWorkerSlot *slot;
+	uint64		elapsed = (uint64) INSTR_TIME_GET_MICROSEC(duration);
+
+	if (rage_shared == NULL)
+		return;
+
+	slot = &rage_shared->workers[worker_index];
+	pg_atomic_fetch_add_u64(&slot->rounds, 1);
+	pg_rage_terminator_count_kills(kills);
+	pg_atomic_fetch_add_u64(&slot->round_time, elapsed);
+	pg_atomic_write_u64(&slot->last_round_time, elapsed);
+	pg_atomic_fetch_add_u64(&slot->cpu_time, cpu_time);
+	pg_atomic_fetch_add_u64(&slot->snapshot_time,
+							(uint64) INSTR_TIME_GET_MICROSEC(round_snapshot_time));
+	pg_atomic_fetch_add_u64(&slot->signal_time,
+							(uint64) INSTR_TIME_GET_MICROSEC(round_signal_time));
+}
+
+/*
+ * Split a comma separated list into its trimmed elements. Unlike
+ * SplitIdentifierString(), elements may contain spaces and are taken
+ * as they are. The elements are allocated in the current context.
+ */
+static List *
+pg_rage_terminator_split_list(const char *str)
+{
+	List	   *elems = NIL;
+	const char *p = str;
+
+	while (*p)
+	{
+		const char *start;
+		const char *end;
+
+		while (*p == ' ' || *p == ',')
+			p++;
+		if (*p == '\0')
+			break;
+
+		start = p;
+		while (*p && *p != ',')
+			p++;
+		end = p;
+		while (end > start && end[-1] == ' ')
+			end--;
+
+		elems = lappend(elems, pnstrdup(start, end - start));
+	}
+
+	return elems;
+}
+
+static BackendState
+pg_rage_terminator_parse_state(const char *name)
+{
+	int			i;
+
+	for (i = 0; state_names[i].name != NULL; i++)
+	{
+		if (pg_strcasecmp(state_names[i].name, name) == 0)
+			return state_names[i].state;
+	}
+
+	return STATE_UNDEFINED;
+}
+
+/*
+ * Resolve a list of database or role names into an OID filter. Unknown
+ * names are reported and skipped. Needs a transaction.
+ */
+static void
+pg_rage_terminator_compile_oid_filter(RageOidFilter *filter,
+									  const char *setting,
+									  const char *guc_name,
+									  bool is_role)
+{
+	char	   *rawstring;
+	List	   *names;
+	ListCell   *lc;
+
+	filter->active = false;
+	filter->noids = 0;
+	filter->oids = NULL;
+
+	if (setting == NULL || setting[0] == '\0')
+		return;
+
+	rawstring = pstrdup(setting);
+	if (!SplitIdentifierString(rawstring, ',', &names))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid list syntax in parameter \"%s\"", guc_name)));
+		pfree(rawstring);
+		list_free(names);
+		return;
+	}
+
+	/*
+	 * An active filter with unknown names only matches nothing, rather
+	 * than turning into "everything".
+	 */
+	filter->active = true;
+	filter->oids = MemoryContextAlloc(config_context,
+									  Max(list_length(names), 1) * sizeof(Oid));
+
+	foreach(lc, names)
+	{
+		char	   *name = (char *) lfirst(lc);
+		Oid			oid;
+
+		if (is_role)
+			oid = get_role_oid(name, true);
+		else
+			oid = get_database_oid(name, true);
+
+		if (!OidIsValid(oid))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("%s \"%s\" in parameter \"%s\" does not exist",
+							is_role ? "role" : "database", name, guc_name)));
+			continue;
+		}
+
+		filter->oids[filter->noids++] = oid;
+	}
+
+	pfree(rawstring);
+	list_free(names);
+}
+
+static int
+pg_rage_terminator_window_cmp(const void *a, const void *b)
+{
+	const RageWindow *wa = (const RageWindow *) a;
+	const RageWindow *wb = (const RageWindow *) b;
+
+	if (wa->start != wb->start)
+		return wa->start < wb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Add a window to the schedule table, splitting it at midnight.
+ */
+static void
+pg_rage_terminator_add_window(int start, int end, int window_chance, Oid datid,
+							  int *maxwindows)
+{
+	if (nwindows + 2 > *maxwindows)
+	{
+		*maxwindows *= 2;
+		schedule = repalloc(schedule, *maxwindows * sizeof(RageWindow));
+	}
+
+	if (end <= start)
+	{
+		if (end > 0)
+		{
+			schedule[nwindows].start = 0;
+			schedule[nwindows].end = end;
+			schedule[nwindows].chance = window_chance;
+			schedule[nwindows].datid = datid;
+			nwindows++;
+		}
+		end = RAGE_MINUTES_PER_DAY;
+	}
+
+	schedule[nwindows].start = start;
+	schedule[nwindows].end = end;
+	schedule[nwindows].chance = window_chance;
+	schedule[nwindows].datid = datid;
+	nwindows++;
+}
+
+/*
+ * Compile the schedule setting into the sorted window table. Every entry
+ * is "HH:MM-HH:MM chance [database]", entries that can't be parsed are
+ * skipped with a warning. Has to be called in a transaction, database
+ * names are resolved to OIDs.
+ */
+static void
+pg_rage_terminator_compile_schedule(void)
+{
+	List	   *entries;
+	ListCell   *lc;
+	int			maxwindows = 8;
+
+	schedule = NULL;
+	nwindows = 0;
+
+	if (schedule_str == NULL || schedule_str[0] == '\0')
+		return;
+
+	/* The table lives until the next reload, the entries don't */
+	schedule = MemoryContextAlloc(config_context,
+								  maxwindows * sizeof(RageWindow));
+	entries = pg_rage_terminator_split_list(schedule_str);
+
+	foreach(lc, entries)
+	{
+		char	   *entry = (char *) lfirst(lc);
+		int			sh, sm, eh, em;
+		int			window_chance;
+		int			len = 0;
+		char	   *dbname;
+		Oid			datid = InvalidOid;
+
+		if (sscanf(entry, "%d:%d-%d:%d %d%n",
+				   &sh, &sm, &eh, &em, &window_chance, &len) != 5 ||
+			sh < 0 || sh > 23 || sm < 0 || sm > 59 ||
+			eh < 0 || eh > 24 || em < 0 || em > 59 ||
+			(eh == 24 && em != 0) ||
+			window_chance < 0 || window_chance > 100)
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid entry \"%s\" in parameter \"%s\"",
+							entry, "pg_rage_terminator.schedule"),
+					 errhint("Entries look like \"05:00-06:00 50 dbname\", the database is optional.")));
+			continue;
+		}
+
+		dbname = entry + len;
+		while (*dbname == ' ' || *dbname == '\t')
+			dbname++;
+		if (*dbname != '\0')
+		{
+			datid = get_database_oid(dbname, true);
+			if (!OidIsValid(datid))
+			{
+				ereport(WARNING,
+						(errcode(ERRCODE_UNDEFINED_OBJECT),
+						 errmsg("database \"%s\" in parameter \"%s\" does not exist",
+								dbname, "pg_rage_terminator.schedule")));
+				continue;
+			}
+		}
+
+		pg_rage_terminator_add_window(sh * 60 + sm, eh * 60 + em,
+									  window_chance, datid, &maxwindows);
+	}
+
+	list_free_deep(entries);
+	qsort(schedule, nwindows, sizeof(RageWindow),
+		  pg_rage_terminator_window_cmp);
+}
+
+/*
+ * Compile the chance map setting into the per database and per role hash
+ * tables. Entries are "database:chance" or "role=name:chance". Has to be
+ * called in a transaction, names are resolved to OIDs.
+ */
+static void
+pg_rage_terminator_compile_chance_map(void)
+{
+	HASHCTL		ctl;
+	List	   *entries;
+	ListCell   *lc;
+
+	chance_map_databases = NULL;
+	chance_map_roles = NULL;
+	chance_map_active = false;
+
+	if (chance_map_str == NULL || chance_map_str[0] == '\0')
+		return;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(RageChanceEntry);
+	ctl.hcxt = config_context;
+	chance_map_databases = hash_create("pg_rage_terminator chance map databases",
+									   16, &ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	chance_map_roles = hash_create("pg_rage_terminator chance map roles",
+								   16, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	entries = pg_rage_terminator_split_list(chance_map_str);
+	foreach(lc, entries)
+	{
+		char	   *entry = (char *) lfirst(lc);
+		char	   *name = entry;
+		char	   *sep = strrchr(entry, ':');
+		char	   *end = NULL;
+		bool		is_role = false;
+		long		map_chance = -1;
+		Oid			oid;
+		RageChanceEntry *map_entry;
+
+		if (strncmp(name, "role=", 5) == 0)
+		{
+			is_role = true;
+			name += 5;
+		}
+
+		if (sep != NULL)
+		{
+			*sep = '\0';
+			map_chance = strtol(sep + 1, &end, 10);
+		}
+		if (sep == NULL || name == sep || *end != '\0' || end == sep + 1 ||
+			map_chance < 0 || map_chance > 100)
+		{
+			/* Report the whole entry */
+			if (sep != NULL)
+				*sep = ':';
+			ereport(WARNING,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid entry \"%s\" in parameter \"%s\"",
+							entry, "pg_rage_terminator.chance_map"),
+					 errhint("Entries look like \"dbname:30\" or \"role=rolename:50\".")));
+			continue;
+		}
+
+		if (is_role)
+			oid = get_role_oid(name, true);
+		else
+			oid = get_database_oid(name, true);
+
+		if (!OidIsValid(oid))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("%s \"%s\" in parameter \"%s\" does not exist",
+							is_role ? "role" : "database", name,
+							"pg_rage_terminator.chance_map")));
+			continue;
+		}
+
+		map_entry = hash_search(is_role ? chance_map_roles : chance_map_databases,
+								&oid, HASH_ENTER, NULL);
+		map_entry->chance = (int) map_chance;
+		chance_map_active = true;
+	}
+
+	list_free_deep(entries);
+}
+
+/*
+ * Chance of a candidate: its role's entry in the chance map, else its
+ * database's entry, else the chance of the round.
+ */
+static int
+pg_rage_terminator_chance_of(const RageCandidate *cand)
+{
+	RageChanceEntry *entry;
+
+	entry = hash_search(chance_map_roles, &cand->userid, HASH_FIND, NULL);
+	if (entry == NULL)
+		entry = hash_search(chance_map_databases, &cand->datid, HASH_FIND, NULL);
+
+	return entry != NULL ? entry->chance : round_chance;
+}
+
+/*
+ * Seconds since local midnight, in the server's time zone.
+ */
+static int
+pg_rage_terminator_local_seconds(TimestampTz now)
+{
+	pg_time_t	t = timestamptz_to_time_t(now);
+	struct pg_tm *tm = pg_localtime(&t, session_timezone);
+
+	return tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+}
+
+/*
+ * Set the chance and database of a round due at now. Without a schedule,
+ * or outside of all windows, the chance setting applies. Windows are
+ * looked at in the order of their start, the first one containing now
+ * wins.
+ */
+static void
+pg_rage_terminator_schedule_round(TimestampTz now)
+{
+	int			minute;
+	int			i;
+
+	round_chance = chance;
+	round_datid = InvalidOid;
+
+	if (nwindows == 0)
+		return;
+
+	minute = pg_rage_terminator_local_seconds(now) / 60;
+	for (i = 0; i < nwindows && schedule[i].start <= minute; i++)
+	{
+		if (minute < schedule[i].end)
+		{
+			round_chance = schedule[i].chance;
+			round_datid = schedule[i].datid;
+			return;
+		}
+	}
+}
+
+/*
+ * Milliseconds from now until the chance of the schedule may change: the
+ * end of a window now is in, or the start of the next window, whichever
+ * comes first.
+ */
+static long
+pg_rage_terminator_ms_until_schedule_change(TimestampTz now)
+{
+	int			secs = pg_rage_terminator_local_seconds(now);
+	int			next = -1;
+	int			i;
+
+	Assert(nwindows > 0);
+
+	for (i = 0; i < nwindows; i++)
+	{
+		int			boundary;
+
+		if (schedule[i].start * 60 > secs)
+			boundary = schedule[i].start * 60;
+		else if (schedule[i].end * 60 > secs)
+			boundary = schedule[i].end * 60;
+		else
+			continue;
+
+		if (next < 0 || boundary < next)
+			next = boundary;
+	}
+
+	if (next >= 0)
+		return (next - secs) * 1000L;
+
+	/* Nothing left today, the first window of tomorrow */
+	return (RAGE_MINUTES_PER_DAY * 60L - secs + schedule[0].start * 60L) * 1000L;
+}
+
+/*
+ * Compile the targeting filter settings. Called at worker start and on
+ * every reload.
+ */
+static void
+pg_rage_terminator_compile_filters(void)
+{
+	MemoryContext oldcontext;
+	List	   *states;
+	ListCell   *lc;
+
+	/* Throw away what the previous settings were compiled into */
+	if (config_context == NULL)
+		config_context = AllocSetContextCreate(TopMemoryContext,
+											   "pg_rage_terminator config",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
+	else
+		MemoryContextReset(config_context);
+	filter_application_names = NIL;
+
+	/* Catalog lookups need a transaction */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	pg_rage_terminator_compile_oid_filter(&filter_databases,
+										  filter_databases_str,
+										  "pg_rage_terminator.databases",
+										  false);
+	pg_rage_terminator_compile_oid_filter(&filter_exclude_databases,
+										  filter_exclude_databases_str,
+										  "pg_rage_terminator.exclude_databases",
+										  false);
+	pg_rage_terminator_compile_oid_filter(&filter_roles,
+										  filter_roles_str,
+										  "pg_rage_terminator.roles",
+										  true);
+	pg_rage_terminator_compile_oid_filter(&filter_exclude_roles,
+										  filter_exclude_roles_str,
+										  "pg_rage_terminator.exclude_roles",
+										  true);
+	pg_rage_terminator_compile_schedule();
+	pg_rage_terminator_compile_chance_map();
+
+	CommitTransactionCommand();
+
+	/* The remaining filters live until the next reload */
+	oldcontext = MemoryContextSwitchTo(config_context);
+
+	if (filter_application_names_str != NULL)
+		filter_application_names =
+			pg_rage_terminator_split_list(filter_application_names_str);
+
+	/* Unknown addresses only match nothing, like unknown names */
+	filter_client_addrs.active = false;
+	filter_client_addrs.naddrs = 0;
+	filter_client_addrs.addrs = NULL;
+	if (filter_client_addrs_str != NULL && filter_client_addrs_str[0] != '\0')
+	{
+		List	   *addrs = pg_rage_terminator_split_list(filter_client_addrs_str);
+
+		filter_client_addrs.active = true;
+		filter_client_addrs.addrs = palloc(Max(list_length(addrs), 1) *
+										   sizeof(RageAddr));
+		foreach(lc, addrs)
+		{
+			char	   *str = (char *) lfirst(lc);
+			RageAddr   *addr = &filter_client_addrs.addrs[filter_client_addrs.naddrs];
+
+			pg_rage_terminator_addr_from_string(addr, str);
+			if (addr->family == 0)
+				ereport(WARNING,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid client address \"%s\" in parameter \"%s\"",
+								str, "pg_rage_terminator.client_addrs")));
+			else
+				filter_client_addrs.naddrs++;
+		}
+		list_free_deep(addrs);
+	}
+
+	filter_states = 0;
+	if (filter_states_str != NULL)
+	{
+		states = pg_rage_terminator_split_list(filter_states_str);
+		foreach(lc, states)
+		{
+			char	   *name = (char *) lfirst(lc);
+			BackendState state = pg_rage_terminator_parse_state(name);
+
+			if (state == STATE_UNDEFINED)
+				ereport(WARNING,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("unknown backend state \"%s\" in parameter \"%s\"",
+								name, "pg_rage_terminator.states")));
+			else
+				filter_states |= (1 << state);
+		}
+		list_free_deep(states);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+static bool
+pg_rage_terminator_filter_has(const RageOidFilter *filter, Oid oid)
+{
+	int			i;
+
+	for (i = 0; i < filter->noids; i++)
+	{
+		if (filter->oids[i] == oid)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check a candidate against the targeting filters.
+ */
+static bool
+pg_rage_terminator_match(const RageCandidate *cand)
+{
+	ListCell   *lc;
+
+	if (OidIsValid(round_datid) && cand->datid != round_datid)
+		return false;
+	if (filter_databases.active &&
+		!pg_rage_terminator_filter_has(&filter_databases, cand->datid))
+		return false;
+	if (pg_rage_terminator_filter_has(&filter_exclude_databases, cand->datid))
+		return false;
+	if (filter_roles.active &&
+		!pg_rage_terminator_filter_has(&filter_roles, cand->userid))
+		return false;
+	if (pg_rage_terminator_filter_has(&filter_exclude_roles, cand->userid))
+		return false;
+	if (filter_states != 0 && (filter_states & (1 << cand->state)) == 0)
+		return false;
+
+	/* String compares come last, and only if asked for */
+	if (filter_application_names == NIL)
+		return true;
+	if (cand->appname == NULL)
+		return false;
+	foreach(lc, filter_application_names)
+	{
+		if (strcmp((char *) lfirst(lc), cand->appname) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check the client address of a candidate against client_addrs. Done
+ * apart from the other filters, the address is only converted for the
+ * candidates that passed them.
+ */
+static bool
+pg_rage_terminator_match_addr(const RageCandidate *cand)
+{
+	int			i;
+
+	if (!filter_client_addrs.active)
+		return true;
+
+	for (i = 0; i < filter_client_addrs.naddrs; i++)
+	{
+		if (memcmp(&filter_client_addrs.addrs[i], &cand->client_addr,
+				   sizeof(RageAddr)) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add a victim to the kill history.
+ */
+static void
+pg_rage_terminator_record(int pid, Oid datid, Oid userid, const RageAddr *addr,
+						  BackendState state, int64 query_id, bool canceled)
+{
+	RageHistoryEntry *entry;
+	uint64		n;
+
+	if (rage_history == NULL)
+		return;
+
+	n = pg_atomic_fetch_add_u64(&rage_shared->history_next, 1);
+	entry = &rage_history[n % history_size];
+
+	/* Both increments are full barriers around the update */
+	pg_atomic_fetch_add_u32(&entry->changecount, 1);
+	entry->kill.seq = n;
+	entry->kill.pid = pid;
+	entry->kill.kill_time = GetCurrentTimestamp();
+	entry->kill.datid = datid;
+	entry->kill.userid = userid;
+	entry->kill.client_addr = *addr;
+	entry->kill.query_id = query_id;
+	entry->kill.state = state;
+	entry->kill.canceled = canceled;
+	entry->kill.dry_run = dry_run;
+	pg_atomic_fetch_add_u32(&entry->changecount, 1);
+}
+
+/*
+ * Database and role of a candidate as they are logged: the names the SQL
+ * scan got, the OIDs otherwise.
+ */
+static void
+pg_rage_terminator_format_who(const RageCandidate *cand, char *buf, size_t len)
+{
+	if (cand->who != NULL)
+		strlcpy(buf, cand->who, len);
+	else
+		snprintf(buf, len, "%u/%u", cand->datid, cand->userid);
+}
+
+/*
+ * Account and log a terminated backend.
+ */
+static void
+pg_rage_terminator_terminated(int pid, Oid datid, Oid userid,
+							  const RageAddr *addr, const char *who)
+{
+	char		client_addr[RAGE_ADDR_LEN];
+
+	pg_rage_terminator_format_addr(addr, client_addr, sizeof(client_addr));
+	pg_rage_terminator_count_kill(datid, userid, client_addr);
+
+	/* Watch for the client to come back, nobody leaves in a dry run */
+	if (reconnect_target > 0 && !dry_run &&
+		nreconnects < RAGE_RECONNECT_SAMPLES)
+	{
+		RageReconnect *sample = &reconnects[nreconnects++];
+
+		sample->datid = datid;
+		sample->userid = userid;
+		sample->client_addr = *addr;
+		sample->kill_time = GetCurrentTimestamp();
+	}
+
+	/* Log what has been disconnected */
+	if (pg_rage_terminator_log_victim())
+		elog(LOG, "Rage terminated connection with PID %d %s/%s%s",
+			 pid, who, client_addr[0] ? client_addr : "none",
+			 dry_run ? " (dry run)" : "");
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Remember a victim whose query has been canceled, to check on it
+ * after escalate_timeout.
+ */
+static void
+pg_rage_terminator_add_pending(const RageCandidate *cand)
+{
+	RagePending *entry;
+	bool		found;
+
+	if (pending == NULL)
+		pending = rage_pending_create(TopMemoryContext, 64, NULL);
+
+	entry = rage_pending_insert(pending, cand->pid, &found);
+	entry->deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												  escalate_timeout);
+	entry->query_start = cand->query_start;
+	entry->datid = cand->datid;
+	entry->userid = cand->userid;
+	pg_rage_terminator_format_who(cand, entry->who, sizeof(entry->who));
+	entry->client_addr = cand->client_addr;
+
+	if (pending_next == 0 || entry->deadline < pending_next)
+		pending_next = entry->deadline;
+}
+#endif
+
+/*
+ * Check whether a backend is in a state where killing it stalls others:
+ * in the middle of a commit, or anything else the checkpointer has to
+ * wait for, or holding an AccessExclusiveLock. Reading the flags without
+ * a lock is fine, the answer is only advisory.
+ */
+static bool
+pg_rage_terminator_is_critical(int pid)
+{
+	PGPROC	   *proc = BackendPidGetProc(pid);
+	int			i;
+
+	if (proc == NULL)
+		return false;
+
+#if PG_VERSION_NUM >= 150000
+	if (proc->delayChkptFlags != 0)
+#else
+	if (proc->delayChkpt)
+#endif
+		return true;
+
+	/*
+	 * AccessExclusiveLock is never taken through the fast path, so only
+	 * the lock partitions the backend holds locks in have to be looked at.
+	 */
+	for (i = 0; i < NUM_LOCK_PARTITIONS; i++)
+	{
+		LWLock	   *partition_lock = LockHashPartitionLockByIndex(i);
+		bool		found = false;
+#if PG_VERSION_NUM >= 160000
+		dlist_head *proc_locks = &proc->myProcLocks[i];
+		dlist_iter	iter;
+
+		if (dlist_is_empty(proc_locks))
+			continue;
+
+		LWLockAcquire(partition_lock, LW_SHARED);
+		dlist_foreach(iter, proc_locks)
+		{
+			PROCLOCK   *proclock = dlist_container(PROCLOCK, procLink, iter.cur);
+
+			if (proclock->holdMask & LOCKBIT_ON(AccessExclusiveLock))
+			{
+				found = true;
+				break;
+			}
+		}
+#else
+		SHM_QUEUE  *proc_locks = &proc->myProcLocks[i];
+		PROCLOCK   *proclock;
+
+		if (SHMQueueEmpty(proc_locks))
+			continue;
+
+		LWLockAcquire(partition_lock, LW_SHARED);
+		proclock = (PROCLOCK *) SHMQueueNext(proc_locks, proc_locks,
+											 offsetof(PROCLOCK, procLink));
+		while (proclock != NULL)
+		{
+			if (proclock->holdMask & LOCKBIT_ON(AccessExclusiveLock))
+			{
+				found = true;
+				break;
+			}
+			proclock = (PROCLOCK *) SHMQueueNext(proc_locks, &proclock->procLink,
+												 offsetof(PROCLOCK, procLink));
+		}
+#endif
+		LWLockRelease(partition_lock);
+
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check whether a victim has to be spared, see spare_critical.
+ */
+static bool
+pg_rage_terminator_spare(int pid)
+{
+	if (spare_critical && pg_rage_terminator_is_critical(pid))
+	{
+		elog(DEBUG1, "pg_rage_terminator: sparing PID %d, it is committing or holds an AccessExclusiveLock",
+			 pid);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Do to a victim what kill_mode says. Returns true if the victim has
+ * been terminated.
+ */
+static bool
+pg_rage_terminator_act(const RageCandidate *cand)
+{
+	char		client_addr[RAGE_ADDR_LEN];
+	char		who[RAGE_WHO_LEN];
+
+	if (pg_rage_terminator_spare(cand->pid))
+		return false;
+
+	pg_rage_terminator_format_who(cand, who, sizeof(who));
+
+	if (kill_mode == RAGE_KILL_TERMINATE)
+	{
+		if (!pg_rage_terminator_signal(cand->pid, SIGTERM))
+			return false;
+
+		pg_rage_terminator_terminated(cand->pid, cand->datid, cand->userid,
+									  &cand->client_addr, who);
+		pg_rage_terminator_record(cand->pid, cand->datid, cand->userid,
+								  &cand->client_addr, cand->state,
+								  cand->query_id, false);
+		return true;
+	}
+
+#if PG_VERSION_NUM >= 100000
+	/* Already canceled, its escalation is pending */
+	if (kill_mode == RAGE_KILL_ESCALATE && pending != NULL &&
+		rage_pending_lookup(pending, cand->pid) != NULL)
+		return false;
+#endif
+
+	if (!pg_rage_terminator_signal(cand->pid, SIGINT))
+		return false;
+
+	round_cancels++;
+	if (rage_shared != NULL)
+	{
+		RageWorkerSlot *slot = &rage_shared->workers[worker_index];
+
+		pg_atomic_fetch_add_u64(dry_run ? &slot->dry_run_cancels :
+								&slot->cancels, 1);
+	}
+	pg_rage_terminator_record(cand->pid, cand->datid, cand->userid,
+							  &cand->client_addr, cand->state,
+							  cand->query_id, true);
+
+	if (pg_rage_terminator_log_victim())
+	{
+		pg_rage_terminator_format_addr(&cand->client_addr,
+									   client_addr, sizeof(client_addr));
+		elog(LOG, "Rage canceled query of connection with PID %d %s/%s%s",
+			 cand->pid, who, client_addr[0] ? client_addr : "none",
+			 dry_run ? " (dry run)" : "");
+	}
+
+#if PG_VERSION_NUM >= 100000
+	if (kill_mode == RAGE_KILL_ESCALATE)
+		pg_rage_terminator_add_pending(cand);
+#endif
+
+	return false;
+}
+
+/*
+ * Act on a victim now, or queue it when the round is spread over a storm
+ * window. Returns true if the victim has been terminated right away.
+ */
+static bool
+pg_rage_terminator_pick(const RageCandidate *cand)
+{
+	if (storm_window == 0 || round_fired)
+		return pg_rage_terminator_act(cand);
+
+	Assert(npaced < maxpaced);
+	paced[npaced].cand = *cand;
+	paced[npaced].cand.appname = NULL;
+	if (cand->who != NULL)
+		paced[npaced].cand.who = MemoryContextStrdup(TopMemoryContext, cand->who);
+	npaced++;
+
+	return false;
+}
+
+static int
+pg_rage_terminator_paced_cmp(const void *a, const void *b)
+{
+	const RagePaced *pa = (const RagePaced *) a;
+	const RagePaced *pb = (const RagePaced *) b;
+
+	if (pa->due != pb->due)
+		return pa->due < pb->due ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Spread the victims queued by a round evenly over the storm window,
+ * starting now, each delayed by a random jitter of up to storm_jitter.
+ */
+static void
+pg_rage_terminator_schedule_paced(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int			i;
+
+	for (i = 0; i < npaced; i++)
+	{
+		double		offset = (double) storm_window * i / npaced;
+
+		if (storm_jitter > 0)
+			offset += storm_jitter * pg_rage_terminator_random_double();
+		paced[i].due = TimestampTzPlusMilliseconds(now, (int64) offset);
+	}
+
+	if (storm_jitter > 0)
+		qsort(paced, npaced, sizeof(RagePaced), pg_rage_terminator_paced_cmp);
+}
+
+/*
+ * Client backends are the ones with a client address. This mirrors
+ * the "client_port IS NOT NULL" check of the SQL scan.
+ */
+static bool
+pg_rage_terminator_is_client(const PgBackendStatus *beentry)
+{
+	SockAddr	zero_clientaddr;
+
+	memset(&zero_clientaddr, 0, sizeof(zero_clientaddr));
+	return memcmp(&beentry->st_clientaddr, &zero_clientaddr,
+				  sizeof(zero_clientaddr)) != 0;
+}
+
+/*
+ * Take a fresh snapshot of the status array for the queued victims due
+ * now. The caller has to release it with pgstat_clear_snapshot().
+ */
+static void
+pg_rage_terminator_refresh_live(void)
+{
+#if PG_VERSION_NUM >= 100000
+	int			num_backends;
+	int			i;
+#endif
+
+	pgstat_clear_snapshot();
+
+#if PG_VERSION_NUM >= 100000
+	num_backends = pgstat_fetch_stat_numbackends();
+	if (live != NULL)
+		rage_live_destroy(live);
+	live = rage_live_create(TopMemoryContext, Max(num_backends, 1), NULL);
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		RageLive   *entry;
+		bool		found;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		entry = rage_live_insert(live, local_beentry->backendStatus.st_procpid,
+								 &found);
+		entry->beentry = &local_beentry->backendStatus;
+	}
+#endif
+}
+
+/*
+ * Check that a queued victim is still the backend the round picked. Up
+ * to storm_window later, its PID may belong to a new backend the filters
+ * would never have let through. Looks in the snapshot taken by
+ * pg_rage_terminator_refresh_live().
+ */
+static bool
+pg_rage_terminator_still_there(const RageCandidate *cand)
+{
+	PgBackendStatus *beentry = NULL;
+#if PG_VERSION_NUM >= 100000
+	RageLive   *entry = rage_live_lookup(live, cand->pid);
+
+	if (entry != NULL)
+		beentry = entry->beentry;
+#else
+	int			num_backends = pgstat_fetch_stat_numbackends();
+	int			i;
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry != NULL &&
+			local_beentry->backendStatus.st_procpid == cand->pid)
+		{
+			beentry = &local_beentry->backendStatus;
+			break;
+		}
+	}
+#endif
+
+	return beentry != NULL &&
+		beentry->st_proc_start_timestamp == cand->proc_start &&
+		beentry->st_databaseid == cand->datid &&
+		beentry->st_userid == cand->userid &&
+		pg_rage_terminator_is_client(beentry);
+}
+
+/*
+ * Act on the queued victims that are due. The clock is read again only
+ * when the next victim is not due yet, so a burst of victims due at the
+ * same time costs one clock read each at most.
+ */
+static void
+pg_rage_terminator_pace(void)
+{
+	TimestampTz now;
+	int			killed = 0;
+	bool		checked = false;
+
+	if (paced_next >= npaced)
+		return;
+
+	now = GetCurrentTimestamp();
+	rage_wait_start(wait_event_signal);
+	while (paced_next < npaced)
+	{
+		RageCandidate *cand = &paced[paced_next].cand;
+
+		if (paced[paced_next].due > now)
+		{
+			now = GetCurrentTimestamp();
+			if (paced[paced_next].due > now)
+				break;
+		}
+
+		/* Read the status array fresh, once for all victims due now */
+		if (!checked)
+		{
+			pg_rage_terminator_refresh_live();
+			checked = true;
+		}
+
+		if (!pg_rage_terminator_still_there(cand))
+			elog(DEBUG1, "pg_rage_terminator: PID %d is gone, not signaling it",
+				 cand->pid);
+		else if (pg_rage_terminator_act(cand))
+			killed++;
+		if (cand->who != NULL)
+			pfree((char *) cand->who);
+		paced_next++;
+	}
+	if (checked)
+		pgstat_clear_snapshot();
+	rage_wait_end();
+
+	pg_rage_terminator_count_kills(killed);
+	paced_killed += killed;
+
+	/* The storm is over, log it like a round */
+	if (paced_next >= npaced)
+	{
+		pg_rage_terminator_log_round(paced_killed);
+		npaced = 0;
+		paced_next = 0;
+		paced_killed = 0;
+	}
+}
+
+/*
+ * Start time a candidate is ranked by in the oldest_* selections.
+ * Candidates without a query or transaction go last.
+ */
+static TimestampTz
+pg_rage_terminator_age(const RageCandidate *cand)
+{
+	TimestampTz start;
+
+	if (selection == RAGE_SELECT_OLDEST_XACT)
+		start = cand->xact_start;
+	else
+		start = cand->query_start;
+
+	return start != 0 ? start : DT_NOEND;
+}
+
+/*
+ * Heap order of the oldest_* selections. The youngest of the victims
+ * kept so far is on top, so it is the one replaced by an older candidate.
+ */
+static int
+pg_rage_terminator_age_cmp(Datum a, Datum b, void *arg)
+{
+	RageCandidate *cands = (RageCandidate *) arg;
+	TimestampTz age_a = pg_rage_terminator_age(&cands[DatumGetInt32(a)]);
+	TimestampTz age_b = pg_rage_terminator_age(&cands[DatumGetInt32(b)]);
+
+	if (age_a < age_b)
+		return -1;
+	if (age_a > age_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Pick the oldest candidates as victims. The number of victims is drawn
+ * the same way as for the random selection, so the chance keeps its
+ * meaning, only who is hit changes. The victims are collected in a heap
+ * of that size, which keeps the cost at O(n log k) for n candidates and
+ * k victims. Returns the number of terminated backends.
+ */
+static int
+pg_rage_terminator_kill_oldest(RageCandidate *cands, int ncands)
+{
+	binaryheap *heap;
+	int			nvictims = 0;
+	int			killed = 0;
+	int			i;
+
+	/* Count the victims the random selection would have hit */
+	if (chance_map_active)
+	{
+		/* Every candidate has its own chance, one draw each */
+		for (i = 0; i < ncands; i++)
+		{
+			if (cands[i].chance >= 100 ||
+				pg_rage_terminator_random_double() * 100 < cands[i].chance)
+				nvictims++;
+		}
+		i = ncands;
+	}
+	else
+		i = round_chance < 100 ? pg_rage_terminator_skip(round_chance) : 0;
+	while (i < ncands)
+	{
+		int			skip;
+
+		nvictims++;
+		if (round_chance == 100)
+		{
+			nvictims = ncands;
+			break;
+		}
+		skip = pg_rage_terminator_skip(round_chance);
+		if (skip >= ncands - i)
+			break;
+		i += skip + 1;
+	}
+
+	/* Only as many victims as the budget allows */
+	nvictims = pg_rage_terminator_take_budget(nvictims);
+	if (nvictims == 0)
+		return 0;
+
+	heap = binaryheap_allocate(nvictims, pg_rage_terminator_age_cmp, cands);
+	for (i = 0; i < nvictims; i++)
+		binaryheap_add_unordered(heap, Int32GetDatum(i));
+	binaryheap_build(heap);
+
+	for (i = nvictims; i < ncands; i++)
+	{
+		int			youngest = DatumGetInt32(binaryheap_first(heap));
+
+		if (pg_rage_terminator_age(&cands[i]) <
+			pg_rage_terminator_age(&cands[youngest]))
+			binaryheap_replace_first(heap, Int32GetDatum(i));
+	}
+
+	while (!binaryheap_empty(heap))
+	{
+		int			victim = DatumGetInt32(binaryheap_remove_first(heap));
+
+		if (pg_rage_terminator_pick(&cands[victim]))
+			killed++;
+	}
+
+	binaryheap_free(heap);
+
+	return killed;
+}
+
+/*
+ * Pick random victims out of the candidates and act on them. Victims are
+ * chosen by skipping a geometrically distributed number of candidates,
+ * so the cost is in the number of victims, not candidates. Picking stops
+ * once the kill budget is used up. Returns the number of terminated
+ * backends.
+ */
+static int
+pg_rage_terminator_kill_random(RageCandidate *cands, int ncands)
+{
+	int			killed = 0;
+	int			i;
+
+	/* Every candidate has its own chance, one draw each */
+	if (chance_map_active)
+	{
+		for (i = 0; i < ncands; i++)
+		{
+			if (cands[i].chance < 100 &&
+				pg_rage_terminator_random_double() * 100 >= cands[i].chance)
+				continue;
+
+			if (pg_rage_terminator_take_budget(1) == 0)
+				break;
+
+			if (pg_rage_terminator_pick(&cands[i]))
+				killed++;
+		}
+
+		return killed;
+	}
+
+	i = round_chance < 100 ? pg_rage_terminator_skip(round_chance) : 0;
+	while (i < ncands)
+	{
+		/* Out of budget, the remaining candidates are spared */
+		if (pg_rage_terminator_take_budget(1) == 0)
+			break;
+
+		if (pg_rage_terminator_pick(&cands[i]))
+			killed++;
+
+		/* Jump to the next victim */
+		if (round_chance < 100)
+		{
+			int			skip = pg_rage_terminator_skip(round_chance);
+
+			if (skip >= ncands - i)
+				break;
+			i += skip;
+		}
+		i++;
+	}
+
+	return killed;
+}
+
+/*
+ * Order of the candidates by their cohort, so members of a cohort are
+ * next to each other.
+ */
+static int
+pg_rage_terminator_cohort_cmp(const void *a, const void *b)
+{
+	const RageCandidate *ca = (const RageCandidate *) a;
+	const RageCandidate *cb = (const RageCandidate *) b;
+
+	if (cohort == RAGE_COHORT_CLIENT_ADDR)
+		return memcmp(&ca->client_addr, &cb->client_addr, sizeof(RageAddr));
+
+	if (ca->appname == NULL || cb->appname == NULL)
+		return (ca->appname != NULL) - (cb->appname != NULL);
+	return strcmp(ca->appname, cb->appname);
+}
+
+/*
+ * Pick whole cohorts as victims: the candidates are sorted by cohort, and
+ * every cohort is hit with the chance, the highest chance of its members
+ * with a chance map. All members of a cohort that is hit are signaled in
+ * one go, as far as the budget allows. Returns the number of terminated
+ * backends.
+ */
+static int
+pg_rage_terminator_kill_cohorts(RageCandidate *cands, int ncands)
+{
+	int			killed = 0;
+	int			first;
+	int			last;
+
+	qsort(cands, ncands, sizeof(RageCandidate), pg_rage_terminator_cohort_cmp);
+
+	for (first = 0; first < ncands; first = last)
+	{
+		int			cohort_chance = chance_map_active ? 0 : round_chance;
+		int			granted;
+		int			i;
+
+		/* Find the end of the cohort */
+		for (last = first; last < ncands; last++)
+		{
+			if (pg_rage_terminator_cohort_cmp(&cands[first], &cands[last]) != 0)
+				break;
+			if (chance_map_active)
+				cohort_chance = Max(cohort_chance, cands[last].chance);
+		}
+
+		if (cohort_chance < 100 &&
+			pg_rage_terminator_random_double() * 100 >= cohort_chance)
+			continue;
+
+		granted = pg_rage_terminator_take_budget(last - first);
+		for (i = first; i < first + granted; i++)
+		{
+			if (pg_rage_terminator_pick(&cands[i]))
+				killed++;
+		}
+
+		/* Out of budget, the remaining cohorts are spared */
+		if (granted < last - first)
+			break;
+	}
+
+	return killed;
+}
+
+/*
+ * Pick victims out of the candidates of a round and act on them, the way
+ * pg_rage_terminator.cohort and pg_rage_terminator.selection say. Returns
+ * the number of terminated backends.
+ */
+static int
+pg_rage_terminator_kill(RageCandidate *cands, int ncands)
+{
+	int			killed;
+	instr_time	start;
+	instr_time	duration;
+
+	if ((round_chance == 0 && !chance_map_active) || ncands == 0)
+		return 0;
+
+	INSTR_TIME_SET_CURRENT(start);
+	rage_wait_start(wait_event_signal);
+
+	/*
+	 * With a chance map, look up the chance of every candidate once, and
+	 * drop the ones that can't be hit.
+	 */
+	if (chance_map_active)
+	{
+		int			n = 0;
+		int			i;
+
+		for (i = 0; i < ncands; i++)
+		{
+			cands[i].chance = pg_rage_terminator_chance_of(&cands[i]);
+			if (cands[i].chance > 0)
+				cands[n++] = cands[i];
+		}
+		ncands = n;
+	}
+
+	/*
+	 * Make room for the whole round in the storm queue. A fired round
+	 * leaves the queue alone, it signals its victims right away.
+	 */
+	if (!round_fired)
+	{
+		if (storm_window > 0 && ncands > maxpaced)
+		{
+			if (paced != NULL)
+				pfree(paced);
+			maxpaced = ncands;
+			paced = MemoryContextAlloc(TopMemoryContext,
+									   maxpaced * sizeof(RagePaced));
+		}
+		npaced = 0;
+		paced_next = 0;
+		paced_killed = 0;
+	}
+
+	if (cohort != RAGE_COHORT_NONE)
+		killed = pg_rage_terminator_kill_cohorts(cands, ncands);
+	else if (selection == RAGE_SELECT_RANDOM)
+		killed = pg_rage_terminator_kill_random(cands, ncands);
+	else
+		killed = pg_rage_terminator_kill_oldest(cands, ncands);
+
+	if (npaced > 0 && !round_fired)
+		pg_rage_terminator_schedule_paced();
+
+	rage_wait_end();
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_ACCUM_DIFF(round_signal_time, duration, start);
+
+	return killed;
+}
+
+/*
+ * Feed a measured mean reconnect time into the interval controller. The
+ * interval is doubled while clients take longer than reconnect_target to
+ * come back, and shrunk by a quarter of the configured interval per round
+ * otherwise, additive increase and multiplicative decrease of the kill
+ * rate.
+ */
+static void
+pg_rage_terminator_adjust_interval(uint64 reconnect_us)
+{
+	int			max_interval = Min((int64) interval * RAGE_MAX_BACKOFF, 3600000);
+
+	if (reconnect_us > (uint64) reconnect_target * 1000)
+		round_interval = Min((int64) round_interval * 2, max_interval);
+	else
+		round_interval = Max(round_interval - Max(interval / 4, 1), interval);
+
+	elog(DEBUG1, "pg_rage_terminator: reconnect time %.1f ms, interval %d ms",
+		 reconnect_us / 1000.0, round_interval);
+
+	if (rage_shared != NULL)
+	{
+		RageWorkerSlot *slot = &rage_shared->workers[worker_index];
+
+		pg_atomic_write_u64(&slot->effective_interval, round_interval);
+		pg_atomic_write_u64(&slot->reconnect_time, reconnect_us);
+	}
+}
+
+/*
+ * Evaluate the load triggers on the backend status array. Returns true
+ * if a kill round should be done, which is always the case if no
+ * trigger is configured. The copy of the status array is kept for the
+ * native scan if the round is done.
+ */
+static bool
+pg_rage_terminator_check_triggers(void)
+{
+	TimestampTz now;
+	TimestampTz last_check;
+	TimestampTz xact_limit;
+	int			num_backends;
+	int			active = 0;
+	int			connections = 0;
+	bool		old_xact = false;
+	bool		fire = false;
+	int			i;
+
+	if (trigger_active_backends == 0 && trigger_xact_age == 0 &&
+		trigger_connection_rate == 0)
+		return true;
+
+	now = GetCurrentTimestamp();
+	last_check = trigger_check_time;
+	trigger_check_time = now;
+	xact_limit = TimestampTzPlusMilliseconds(now, -trigger_xact_age);
+
+	pgstat_clear_snapshot();
+	num_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		beentry = &local_beentry->backendStatus;
+		if (!pg_rage_terminator_is_client(beentry))
+			continue;
+
+		if (beentry->st_state == STATE_RUNNING)
+			active++;
+		if (beentry->st_xact_start_timestamp != 0 &&
+			beentry->st_xact_start_timestamp <= xact_limit)
+			old_xact = true;
+		if (beentry->st_proc_start_timestamp > last_check)
+			connections++;
+	}
+
+	if (trigger_active_backends > 0 && active >= trigger_active_backends)
+	{
+		elog(DEBUG1, "rage trigger fired: %d active backends", active);
+		fire = true;
+	}
+
+	if (trigger_xact_age > 0 && old_xact)
+	{
+		elog(DEBUG1, "rage trigger fired: transaction older than %d ms",
+			 trigger_xact_age);
+		fire = true;
+	}
+
+	/* The first check has nothing to compare with */
+	if (trigger_connection_rate > 0 && last_check != 0)
+	{
+		long		secs;
+		int			usecs;
+		double		elapsed;
+
+		TimestampDifference(last_check, now, &secs, &usecs);
+		elapsed = secs + usecs / 1000000.0;
+		if (elapsed > 0 && connections / elapsed >= trigger_connection_rate)
+		{
+			elog(DEBUG1, "rage trigger fired: %.1f connections per second",
+				 connections / elapsed);
+			fire = true;
+		}
+	}
+
+	if (!fire)
+	{
+		pgstat_clear_snapshot();
+		if (rage_shared != NULL)
+			pg_atomic_fetch_add_u64(&rage_shared->workers[worker_index].skipped, 1);
+	}
+
+	return fire;
+}
+
+/*
+ * Measure how fast the clients of the sampled victims reconnected: a
+ * client backend of the same database, role and address started after the
+ * kill counts as the victim's client coming back. A victim not back yet
+ * but gone for longer than reconnect_target counts with the time it has
+ * been gone so far, at least that is its reconnect time. The others are
+ * kept for the next measurement. Uses a copy of the status array of its
+ * own.
+ */
+static void
+pg_rage_terminator_measure_reconnects(void)
+{
+	uint64		total = 0;
+	int			nmeasured = 0;
+	int			nkept = 0;
+	bool		back[RAGE_RECONNECT_SAMPLES];
+	TimestampTz first_kill;
+	TimestampTz now;
+	int			num_backends;
+	int			i;
+	int			j;
+
+	if (reconnect_target == 0 || nreconnects == 0)
+		return;
+
+	memset(back, 0, sizeof(back));
+	first_kill = reconnects[0].kill_time;
+	for (j = 1; j < nreconnects; j++)
+		first_kill = Min(first_kill, reconnects[j].kill_time);
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		RageAddr	addr;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		beentry = &local_beentry->backendStatus;
+		if (beentry->st_proc_start_timestamp <= first_kill ||
+			!pg_rage_terminator_is_client(beentry))
+			continue;
+
+		pg_rage_terminator_addr_from_sockaddr(&addr, &beentry->st_clientaddr);
+		for (j = 0; j < nreconnects; j++)
+		{
+			RageReconnect *sample = &reconnects[j];
+
+			if (back[j] ||
+				beentry->st_proc_start_timestamp <= sample->kill_time ||
+				beentry->st_databaseid != sample->datid ||
+				beentry->st_userid != sample->userid ||
+				memcmp(&addr, &sample->client_addr, sizeof(RageAddr)) != 0)
+				continue;
+
+			back[j] = true;
+			nmeasured++;
+			total += beentry->st_proc_start_timestamp - sample->kill_time;
+			break;
+		}
+	}
+	pgstat_clear_snapshot();
+
+	/*
+	 * Clients slower than the interval are never back by the next round,
+	 * so the ones still away count once they are over the target.
+	 */
+	now = GetCurrentTimestamp();
+	for (j = 0; j < nreconnects; j++)
+	{
+		uint64		away = now > reconnects[j].kill_time ?
+			now - reconnects[j].kill_time : 0;
+
+		if (back[j])
+			continue;
+
+		if (away > (uint64) reconnect_target * 1000)
+		{
+			nmeasured++;
+			total += away;
+		}
+		else
+			reconnects[nkept++] = reconnects[j];
+	}
+	nreconnects = nkept;
+
+	if (nmeasured > 0)
+		pg_rage_terminator_adjust_interval(total / nmeasured);
+}
+
+/*
+ * Walk the backend status array and terminate random client backends.
+ * No transaction or snapshot is needed for this, everything is read from
+ * shared memory. Returns the number of terminated backends.
+ */
+static int
+pg_rage_terminator_scan_native(void)
+{
+	RageCandidate *cands;
+	int			ncands = 0;
+	int			num_backends;
+	int			killed;
+	int			i;
+	instr_time	start;
+	instr_time	duration;
+
+	pgstat_report_activity(STATE_RUNNING, "pg_rage_terminator native scan");
+
+	/*
+	 * No copy of the status array is kept between rounds, so this reads a
+	 * fresh one, unless the trigger check of this round just did.
+	 */
+	rage_wait_start(wait_event_scan);
+	INSTR_TIME_SET_CURRENT(start);
+	num_backends = pgstat_fetch_stat_numbackends();
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_ACCUM_DIFF(round_snapshot_time, duration, start);
+	cands = palloc(Max(num_backends, 1) * sizeof(RageCandidate));
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		RageCandidate *cand;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		beentry = &local_beentry->backendStatus;
+		if (beentry->st_procpid == MyProcPid ||
+			!pg_rage_terminator_is_client(beentry))
+			continue;
+
+		/* Leave backends of other workers alone */
+		if (beentry->st_procpid % worker_shards != worker_index)
+			continue;
+
+#if PG_VERSION_NUM >= 100000
+		/* On a standby, only regular client sessions, never a walsender */
+		if (round_read_only && beentry->st_backendType != B_BACKEND)
+			continue;
+#endif
+
+		cand = &cands[ncands];
+		cand->pid = beentry->st_procpid;
+		cand->datid = beentry->st_databaseid;
+		cand->userid = beentry->st_userid;
+		cand->state = beentry->st_state;
+		cand->query_start = beentry->st_activity_start_timestamp;
+		cand->xact_start = beentry->st_xact_start_timestamp;
+		cand->proc_start = beentry->st_proc_start_timestamp;
+#if PG_VERSION_NUM >= 140000
+		cand->query_id = (int64) beentry->st_query_id;
+#else
+		cand->query_id = 0;
+#endif
+		cand->appname = beentry->st_appname;
+		cand->who = NULL;
+		if (!pg_rage_terminator_match(cand))
+			continue;
+
+		pg_rage_terminator_addr_from_sockaddr(&cand->client_addr,
+											  &beentry->st_clientaddr);
+		if (!pg_rage_terminator_match_addr(cand))
+			continue;
+		ncands++;
+	}
+	rage_wait_end();
+
+	killed = pg_rage_terminator_kill(cands, ncands);
+
+	/* Release the local copy of the status array */
+	pfree(cands);
+	pgstat_clear_snapshot();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return killed;
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Check on the pending victims whose deadline has passed. One pass over
+ * the backend status array finds them all, with a hash lookup per
+ * backend; victims still running the canceled query are terminated,
+ * the others are released.
+ */
+static void
+pg_rage_terminator_escalate(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	rage_pending_iterator iter;
+	RagePending *entry;
+	int		   *done;
+	int			ndone = 0;
+	int			num_backends;
+	int			i;
+
+	if (pending_next == 0 || now < pending_next)
+		return;
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		beentry = &local_beentry->backendStatus;
+		entry = rage_pending_lookup(pending, beentry->st_procpid);
+		if (entry == NULL || entry->deadline > now)
+			continue;
+
+		/* The cancel did not stop the query, so terminate */
+		if (beentry->st_state == STATE_RUNNING &&
+			beentry->st_activity_start_timestamp == entry->query_start &&
+			!pg_rage_terminator_spare(entry->pid) &&
+			pg_rage_terminator_signal(entry->pid, SIGTERM))
+		{
+			pg_rage_terminator_terminated(entry->pid, entry->datid,
+										  entry->userid, &entry->client_addr,
+										  entry->who);
+			pg_rage_terminator_record(entry->pid, entry->datid, entry->userid,
+									  &entry->client_addr, beentry->st_state,
+#if PG_VERSION_NUM >= 140000
+									  (int64) beentry->st_query_id,
+#else
+									  0,
+#endif
+									  false);
+			pg_rage_terminator_count_kills(1);
+		}
+	}
+	pgstat_clear_snapshot();
+
+	/*
+	 * Drop all entries past their deadline, including the ones of
+	 * backends that are gone, and find the next deadline.
+	 */
+	done = palloc(Max(pending->members, 1) * sizeof(int));
+	pending_next = 0;
+	rage_pending_start_iterate(pending, &iter);
+	while ((entry = rage_pending_iterate(pending, &iter)) != NULL)
+	{
+		if (entry->deadline <= now)
+			done[ndone++] = entry->pid;
+		else if (pending_next == 0 || entry->deadline < pending_next)
+			pending_next = entry->deadline;
+	}
+	for (i = 0; i < ndone; i++)
+		rage_pending_delete(pending, done[i]);
+	pfree(done);
+}
+#endif
+
+/*
+ * Look for candidates by running the candidate query through SPI and
+ * terminate random ones. The candidates are copied out of the
+ * transaction, so that the snapshot is released before any backend is
+ * signaled. Returns the number of terminated backends.
+ */
+static int
+pg_rage_terminator_scan_spi(void)
+{
+	int ret, i;
+	int killed;
+	Datum values[2];
+	RageCandidate *cands;
+	int ncands = 0;
+	instr_time start;
+	instr_time duration;
+	MemoryContext worker_context = CurrentMemoryContext;
+
+	INSTR_TIME_SET_CURRENT(start);
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	/* Collecting the candidates never writes anything */
+	XactReadOnly = true;
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, kill_query);
+
+	if (kill_plan == NULL)
+		pg_rage_terminator_prepare_query();
+
+	/* Statement start time */
+	SetCurrentStatementStartTimestamp();
+
+	/* Execute query */
+	values[0] = Int32GetDatum(worker_shards);
+	values[1] = Int32GetDatum(worker_index);
+	ret = SPI_execute_plan(kill_plan, values, NULL, true, 0);
+
+	/* Some error handling */
+	if (ret != SPI_OK_SELECT)
+		elog(FATAL, "Error when trying to rage");
+
+	/* Collect the candidates, they have to survive the transaction */
+	cands = MemoryContextAlloc(worker_context,
+							   Max(SPI_processed, 1) * sizeof(RageCandidate));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		RageCandidate *cand = &cands[ncands];
+		char *state;
+		char *datname;
+		char *usename;
+		bool isnull;
+
+		cand->pid = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
+												SPI_tuptable->tupdesc,
+												1, &isnull));
+		cand->datid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+													 SPI_tuptable->tupdesc,
+													 2, &isnull));
+		cand->userid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+													  SPI_tuptable->tupdesc,
+													  3, &isnull));
+		state = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 5);
+		cand->state = state ? pg_rage_terminator_parse_state(state) : STATE_UNDEFINED;
+		cand->appname = SPI_getvalue(SPI_tuptable->vals[i],
+									 SPI_tuptable->tupdesc, 6);
+		cand->query_start = DatumGetTimestampTz(SPI_getbinval(SPI_tuptable->vals[i],
+															  SPI_tuptable->tupdesc,
+															  7, &isnull));
+		if (isnull)
+			cand->query_start = 0;
+		cand->xact_start = DatumGetTimestampTz(SPI_getbinval(SPI_tuptable->vals[i],
+															 SPI_tuptable->tupdesc,
+															 8, &isnull));
+		if (isnull)
+			cand->xact_start = 0;
+		cand->proc_start = DatumGetTimestampTz(SPI_getbinval(SPI_tuptable->vals[i],
+															 SPI_tuptable->tupdesc,
+															 9, &isnull));
+		if (isnull)
+			cand->proc_start = 0;
+#if PG_VERSION_NUM >= 140000
+		cand->query_id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],
+													 SPI_tuptable->tupdesc,
+													 12, &isnull));
+		if (isnull)
+			cand->query_id = 0;
+#else
+		cand->query_id = 0;
+#endif
+		if (!pg_rage_terminator_match(cand))
+			continue;
+
+		pg_rage_terminator_addr_from_string(&cand->client_addr,
+											SPI_getvalue(SPI_tuptable->vals[i],
+														 SPI_tuptable->tupdesc,
+														 4));
+		if (!pg_rage_terminator_match_addr(cand))
+			continue;
+		if (cand->appname != NULL)
+			cand->appname = MemoryContextStrdup(worker_context, cand->appname);
+		datname = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 10);
+		usename = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 11);
+		cand->who = MemoryContextStrdup(worker_context,
+										psprintf("%s/%s",
+												 datname ? datname : "none",
+												 usename ? usename : "none"));
+		ncands++;
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_ACCUM_DIFF(round_snapshot_time, duration, start);
+
+	/* Committing leaves us in TopMemoryContext, go back to the round's */
+	MemoryContextSwitchTo(worker_context);
+
+	/* No transaction and snapshot are held while signaling */
+	killed = pg_rage_terminator_kill(cands, ncands);
+
+	for (i = 0; i < ncands; i++)
+	{
+		if (cands[i].appname != NULL)
+			pfree((char *) cands[i].appname);
+		pfree((char *) cands[i].who);
+	}
+	pfree(cands);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return killed;
+}
+
+/*
+ * Clear our slot in shared memory on exit.
+ */
+static void
+pg_rage_terminator_detach(int code, Datum arg)
+{
+	RageWorkerSlot *slot;
+
+	if (rage_shared == NULL)
+		return;
+
+	slot = &rage_shared->workers[worker_index];
+
+	SpinLockAcquire(&rage_shared->mutex);
+	slot->pid = 0;
+	slot->latch = NULL;
+	slot->paused = false;
+	SpinLockRelease(&rage_shared->mutex);
+}
+
+/*
+ * Enter or leave the paused state, in which the worker sleeps until it is
+ * woken up by a signal.
+ */
+static void
+pg_rage_terminator_set_paused(bool paused)
+{
+	if (paused)
+		ereport(LOG,
+				(errmsg("pg_rage_terminator paused"),
+				 errdetail("pg_rage_terminator.interval is 0.")));
+	else
+		ereport(LOG,
+				(errmsg("pg_rage_terminator resumed")));
+
+	if (rage_shared == NULL)
+		return;
+
+	SpinLockAcquire(&rage_shared->mutex);
+	rage_shared->workers[worker_index].paused = paused;
+	SpinLockRelease(&rage_shared->mutex);
+}
+
+/*
+ * Register this worker in its slot in shared memory. Without shared
+ * memory, i.e. for a launched worker of a library not preloaded, there
+ * is nothing to register.
+ */
+static void
+pg_rage_terminator_attach(void)
+{
+	RageWorkerSlot *slot;
+
+	if (rage_shared == NULL)
+		return;
+
+	slot = &rage_shared->workers[worker_index];
+
+	SpinLockAcquire(&rage_shared->mutex);
+	if (slot->pid != 0)
+	{
+		SpinLockRelease(&rage_shared->mutex);
+		ereport(ERROR,
+				(errmsg("pg_rage_terminator worker %d is already running with PID %d",
+						worker_index, (int) slot->pid)));
+	}
+	slot->pid = MyProcPid;
+	slot->latch = &MyProc->procLatch;
+	SpinLockRelease(&rage_shared->mutex);
+
+	before_shmem_exit(pg_rage_terminator_detach, (Datum) 0);
+}
+
+/*
+ * Milliseconds until the given time, rounded up. 0 if it has passed.
+ */
+static long
+pg_rage_terminator_ms_until(TimestampTz until)
+{
+	long		secs;
+	int			usecs;
+
+	TimestampDifference(GetCurrentTimestamp(), until, &secs, &usecs);
+	return secs * 1000 + (usecs + 999) / 1000;
+}
+
+/*
+ * Complain about a SQL scan without a database to run it in, the native
+ * scan is used instead.
+ */
+static void
+pg_rage_terminator_check_scan_mode(void)
+{
+	if (scan_mode == RAGE_SCAN_SQL && !OidIsValid(MyDatabaseId))
+		ereport(WARNING,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_rage_terminator.scan_mode \"sql\" requires pg_rage_terminator.database to be set"),
+				 errdetail("The native scan is used instead.")));
+}
+
+/*
+ * On a standby, either do nothing or stick to the status array, without
+ * a transaction and snapshot that could conflict with recovery. Checked
+ * every round, the server may have been promoted. Returns false if the
+ * round has to be skipped.
+ */
+static bool
+pg_rage_terminator_check_standby(void)
+{
+	round_read_only = false;
+	if (standby_mode != RAGE_STANDBY_ON && RecoveryInProgress())
+	{
+		if (standby_mode == RAGE_STANDBY_OFF)
+			return false;
+		round_read_only = true;
+	}
+
+	return true;
+}
+
+/*
+ * Do a kill round, with the chance and database of the round already set.
+ */
+static void
+pg_rage_terminator_round(void)
+{
+	int			killed;
+	instr_time	round_start;
+	instr_time	round_time;
+	uint64		cpu_start;
+	MemoryContext oldcontext;
+
+	if (round_context == NULL)
+		round_context = AllocSetContextCreate(TopMemoryContext,
+											  "pg_rage_terminator round",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(round_context);
+
+	INSTR_TIME_SET_CURRENT(round_start);
+	INSTR_TIME_SET_ZERO(round_snapshot_time);
+	INSTR_TIME_SET_ZERO(round_signal_time);
+	cpu_start = pg_rage_terminator_cpu_time();
+	log_suppressed = 0;
+	round_cancels = 0;
+	round_victims = 0;
+	if (scan_mode == RAGE_SCAN_NATIVE || !OidIsValid(MyDatabaseId) ||
+		round_read_only)
+		killed = pg_rage_terminator_scan_native();
+	else
+		killed = pg_rage_terminator_scan_spi();
+	INSTR_TIME_SET_CURRENT(round_time);
+	INSTR_TIME_SUBTRACT(round_time, round_start);
+	pg_rage_terminator_count_round(killed, round_time,
+								   pg_rage_terminator_cpu_time() - cpu_start);
+	/* A storm is logged once it is over */
+	if (npaced == 0 || round_fired)
+		pg_rage_terminator_log_round(killed);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(round_context);
+}
+
+/*
+ * Do the rounds asked for by pg_rage_terminator_fire(). Requests coming
+ * in while the round is done are served by the same round. Triggers and
+ * the schedule don't apply, the budget and the chance map do.
+ */
+static void
+pg_rage_terminator_fired_round(void)
+{
+	RageWorkerSlot *slot;
+	uint64		requested;
+	int			fire_chance;
+
+	if (rage_shared == NULL)
+		return;
+
+	slot = &rage_shared->workers[worker_index];
+	SpinLockAcquire(&rage_shared->mutex);
+	requested = pg_atomic_read_u64(&slot->fire_requested);
+	fire_chance = slot->fire_chance;
+	SpinLockRelease(&rage_shared->mutex);
+	if (requested == pg_atomic_read_u64(&slot->fire_done))
+		return;
+
+	/* The schedule does not apply, neither its chance nor its database */
+	round_chance = fire_chance >= 0 ? fire_chance : chance;
+	round_datid = InvalidOid;
+
+	if (pg_rage_terminator_check_standby())
+	{
+		round_fired = true;
+		pg_rage_terminator_round();
+		round_fired = false;
+	}
+
+	pg_atomic_write_u64(&slot->fire_done, requested);
+}
+
+void
+pg_rage_terminator_main(Datum main_arg)
+{
+	TimestampTz next_round;
+	bool		paused = false;
+
+	if (DatumGetInt32(main_arg) == RAGE_DYNAMIC_WORKER)
+	{
+		worker_index = 0;
+		worker_shards = 1;
+	}
+	else
+	{
+		worker_index = DatumGetInt32(main_arg);
+		worker_shards = nworkers;
+	}
+
+	/* Register functions for SIGTERM/SIGHUP management */
+	pqsignal(SIGHUP, pg_rage_terminator_sighup);
+	pqsignal(SIGTERM, pg_rage_terminator_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	pg_rage_terminator_attach();
+	pg_rage_terminator_seed();
+
+#if PG_VERSION_NUM >= 170000
+	wait_event_sleep = WaitEventExtensionNew("PgRageTerminatorSleep");
+	wait_event_scan = WaitEventExtensionNew("PgRageTerminatorScan");
+	wait_event_signal = WaitEventExtensionNew("PgRageTerminatorSignal");
+#endif
+
+	/*
+	 * Only the SQL scan needs a database. Without one the worker is
+	 * connected to the shared catalogs only, which is enough to look up
+	 * the database and role names of the filters.
+	 */
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnection(database[0] != '\0' ? database : NULL,
+										 NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection(database[0] != '\0' ? database : NULL,
+										 NULL);
+#endif
+
+	pg_rage_terminator_compile_filters();
+	pg_rage_terminator_check_scan_mode();
+
+	/* First round after one interval */
+	round_interval = interval;
+	next_round = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), interval);
+
+	while (!got_sigterm)
+	{
+		int rc = 0;
+		int events = WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH;
+		long timeout;
+		int old_interval;
+		TimestampTz now;
+
+		/*
+		 * When paused, sleep until a reload or an escalation is due. There
+		 * is no round to wait for.
+		 */
+		if (0 == interval)
+		{
+			events &= ~WL_TIMEOUT;
+			timeout = -1L;
+		}
+		else
+			timeout = pg_rage_terminator_ms_until(next_round);
+#if PG_VERSION_NUM >= 100000
+		if (pending_next != 0)
+		{
+			events |= WL_TIMEOUT;
+			timeout = timeout < 0 ? pg_rage_terminator_ms_until(pending_next) :
+				Min(timeout, pg_rage_terminator_ms_until(pending_next));
+		}
+#endif
+		if (paced_next < npaced)
+		{
+			long		due = pg_rage_terminator_ms_until(paced[paced_next].due);
+
+			events |= WL_TIMEOUT;
+			timeout = timeout < 0 ? due : Min(timeout, due);
+		}
+
+        /* Wait necessary amount of time */
+        rc = WaitLatch(&MyProc->procLatch,
+                       events,
+                       timeout
+#if PG_VERSION_NUM >= 100000
+					   , wait_event_sleep
+#endif
+			);
+        ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+#if PG_VERSION_NUM >= 140000
+		/* Asked for by pg_log_backend_memory_contexts() */
+		if (LogMemoryContextPending)
+			ProcessLogMemoryContextInterrupt();
+#endif
+
+		/* Process signals */
+		if (got_sighup)
+		{
+			/*
+			 * Process config file. The saved plan does not depend on any
+			 * setting, but the filters have to be compiled again.
+			 */
+			old_interval = interval;
+			ProcessConfigFile(PGC_SIGHUP);
+			got_sighup = false;
+			ereport(LOG, (errmsg("bgworker pg_rage_terminator signal: processed SIGHUP")));
+
+			pg_rage_terminator_compile_filters();
+			pg_rage_terminator_check_scan_mode();
+
+			/* Restart the victim sequence when a new seed is given */
+			if (seed != prng_seed)
+				pg_rage_terminator_seed();
+
+			/*
+			 * Restart the cadence when the interval changed, or when a
+			 * schedule might have moved the next window. Except after a
+			 * pause, a reload only ever brings the next round closer, so
+			 * frequent reloads cannot hold rounds off.
+			 */
+			if (old_interval != interval || reconnect_target == 0)
+				round_interval = interval;
+			if (old_interval != interval || nwindows > 0)
+			{
+				TimestampTz restart;
+
+				restart = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													  round_interval);
+				if (old_interval == 0 || restart < next_round)
+					next_round = restart;
+			}
+		}
+
+		if (got_sigterm)
+		{
+			/* Simply exit */
+			ereport(LOG, (errmsg("bgworker pg_rage_terminator signal: processed SIGTERM")));
+			proc_exit(0);
+		}
+
+#if PG_VERSION_NUM >= 100000
+		/* Terminate canceled victims that are still busy */
+		pg_rage_terminator_escalate();
+#endif
+
+		/* Signal the victims of a storm that are due */
+		pg_rage_terminator_pace();
+
+		/* Rounds fired from SQL are done right away, even when paused */
+		pg_rage_terminator_fired_round();
+
+        /*
+         * If interval is 0 we should not do anything.
+         * This has to be done after sighup and sigterm handling.
+         */
+        if (0 == interval)
+        {
+			if (!paused)
+			{
+				paused = true;
+				pg_rage_terminator_set_paused(true);
+			}
+            continue;
+        }
+		if (paused)
+		{
+			paused = false;
+			pg_rage_terminator_set_paused(false);
+		}
+
+		/* Woken up before the next round is due, e.g. by a reload */
+		now = GetCurrentTimestamp();
+		if (now < next_round)
+			continue;
+
+		/* A storm still in progress holds back the next round */
+		if (paced_next < npaced)
+			continue;
+
+		/* Back off while the last victims are slow to reconnect */
+		pg_rage_terminator_measure_reconnects();
+
+		/*
+		 * Keep a fixed cadence, but don't try to catch up with rounds
+		 * missed because a round took longer than the interval.
+		 */
+		next_round = TimestampTzPlusMilliseconds(next_round, round_interval);
+		if (next_round <= now)
+			next_round = TimestampTzPlusMilliseconds(now, round_interval);
+
+		/*
+		 * With a chance of 0 from the schedule, sleep until the current
+		 * window ends or the next one opens rather than waking up every
+		 * interval.
+		 */
+		pg_rage_terminator_schedule_round(now);
+		if (round_chance == 0 && nwindows > 0 && !chance_map_active)
+		{
+			long		wait = pg_rage_terminator_ms_until_schedule_change(now);
+
+			elog(DEBUG1, "pg_rage_terminator: next schedule change in %ld ms", wait);
+			next_round = TimestampTzPlusMilliseconds(now, wait);
+			continue;
+		}
+
+		if (!pg_rage_terminator_check_standby())
+		{
+			if (rage_shared != NULL)
+				pg_atomic_fetch_add_u64(&rage_shared->workers[worker_index].skipped, 1);
+			continue;
+		}
+
+		/* Don't scan for victims that could not be killed anyway */
+		if (!pg_rage_terminator_budget_left())
+		{
+			if (rage_shared != NULL)
+				pg_atomic_fetch_add_u64(&rage_shared->workers[worker_index].skipped, 1);
+			continue;
+		}
+
+		/* Only rage when the load says so */
+		if (!pg_rage_terminator_check_triggers())
+			continue;
+
+		/* Process idle connection kill */
+		pg_rage_terminator_round();
+	}
+
+	/* No problems, so clean exit */
+	proc_exit(0);
+}
+
+/*
+ * Add the parameters that can only be set at server start. PostgreSQL
+ * refuses to define them once the server runs, so a worker launched
+ * without shared_preload_libraries uses the defaults.
+ */
+static void
+pg_rage_terminator_load_postmaster_params(void)
+{
+	DefineCustomIntVariable("pg_rage_terminator.workers",
+							"Number of terminator workers.",
+							"Backends are distributed over the workers by PID.",
+							&nworkers,
+							1,
+							1,
+							64,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.max_stats",
+							"Maximum number of entries in the kill statistics.",
+							"Kills of new database/role/address combinations "
+							"are not counted once the limit is reached.",
+							&max_stats,
+							1000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.history_size",
+							"Number of victims kept in the kill history.",
+							"0 disables the history.",
+							&history_size,
+							1000,
+							0,
+							1000000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.database",
+							   "Database the workers connect to.",
+							   "Only the sql scan mode needs a database. "
+							   "Empty connects to the shared catalogs only.",
+							   &database,
+							   database,
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+}
+
+static void
+pg_rage_terminator_load_params(void)
+{
+	/*
+	 * Kill backends with a chance of <chance>.
+     * Look every <interval> milliseconds for new targets.
 	 */
 	DefineCustomIntVariable("pg_rage_terminator.chance",
                             "Chance to terminate a backend in Percent (aboslue).",
@@ -247,35 +3535,488 @@ pg_rage_terminator_load_params(void)
                             NULL,
                             NULL);
 
-	DefineCustomIntVariable("pg_rage_terminator.interval",
-                            "Inteval in which pg_rager_terminator looks for new targets (s).",
-                            "Default of 5",
-                            &interval,
-                            5,
-                            -1,
-                            3600,
-                            PGC_SIGHUP,
-                            0,
-                            NULL,
-                            NULL,
-                            NULL);
+	DefineCustomIntVariable("pg_rage_terminator.interval",
+                            "Inteval in which pg_rager_terminator looks for new targets.",
+                            "Default of 5s",
+                            &interval,
+                            5000,
+                            0,
+                            3600000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.reconnect_target",
+							"Reconnect time of terminated clients to hold by stretching the interval.",
+							"0 disables the controller.",
+							&reconnect_target,
+							0,
+							0,
+							3600000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.log_kills",
+							 "How terminated backends are logged.",
+							 "\"all\" logs every terminated backend, \"summary\" "
+							 "one line per round and \"sampled\" adds rate limited "
+							 "lines for single backends to the summary.",
+							 &log_kills,
+							 RAGE_LOG_ALL,
+							 log_kills_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.log_rate_limit",
+							"Maximum number of log lines per second for single "
+							"terminated backends in sampled mode.",
+							NULL,
+							&log_rate_limit,
+							10,
+							1,
+							10000,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.seed",
+							"Seed of the victim selection.",
+							"The same seed replays the same sequence of kill decisions. "
+							"0 seeds the selection randomly on every start.",
+							&seed,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.trigger_active_backends",
+							"Only rage when at least this many client backends are active.",
+							"0 disables this trigger.",
+							&trigger_active_backends,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.trigger_xact_age",
+							"Only rage when a client transaction is running longer than this.",
+							"0 disables this trigger.",
+							&trigger_xact_age,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.trigger_connection_rate",
+							"Only rage when at least this many connections per second are opened.",
+							"0 disables this trigger.",
+							&trigger_connection_rate,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.max_kills_per_round",
+							"Maximum number of victims per round and worker.",
+							"0 means no limit.",
+							&max_kills_per_round,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.max_kills_per_minute",
+							"Maximum number of victims per minute of all workers.",
+							"0 means no limit.",
+							&max_kills_per_minute,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.storm_window",
+							"Time the victims of a round are spread over.",
+							"0 signals all victims of a round at once.",
+							&storm_window,
+							0,
+							0,
+							3600000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.storm_jitter",
+							"Maximum random delay added to every victim of a storm.",
+							NULL,
+							&storm_jitter,
+							0,
+							0,
+							3600000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.databases",
+							   "Only terminate backends of these databases.",
+							   "Comma separated list, empty for all.",
+							   &filter_databases_str,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.exclude_databases",
+							   "Never terminate backends of these databases.",
+							   "Comma separated list, empty for all.",
+							   &filter_exclude_databases_str,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.roles",
+							   "Only terminate backends of these roles.",
+							   "Comma separated list, empty for all.",
+							   &filter_roles_str,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.exclude_roles",
+							   "Never terminate backends of these roles.",
+							   "Comma separated list, empty for all.",
+							   &filter_exclude_roles_str,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.application_names",
+							   "Only terminate backends with these application names.",
+							   "Comma separated list, empty for all.",
+							   &filter_application_names_str,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.client_addrs",
+							   "Only terminate backends with these client addresses.",
+							   "Comma separated list of IP addresses, empty for all.",
+							   &filter_client_addrs_str,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.states",
+							   "Only terminate backends in these states.",
+							   "Comma separated list, empty for all.",
+							   &filter_states_str,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.chance_map",
+							   "Chance overrides per database and role.",
+							   "Comma separated list of \"database:chance\" and "
+							   "\"role=name:chance\" entries, empty for none.",
+							   &chance_map_str,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_rage_terminator.schedule",
+							   "Time windows with their own chance.",
+							   "Comma separated list of \"HH:MM-HH:MM chance [database]\" "
+							   "entries, empty for none.",
+							   &schedule_str,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.kill_mode",
+							 "What is done to the chosen backends.",
+							 "\"terminate\" terminates them, \"cancel\" cancels their "
+							 "query and \"escalate\" cancels their query and terminates "
+							 "them if they are still running it after escalate_timeout.",
+							 &kill_mode,
+							 RAGE_KILL_TERMINATE,
+							 kill_mode_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_rage_terminator.escalate_timeout",
+							"Time after which a canceled backend still running its query is terminated.",
+							NULL,
+							&escalate_timeout,
+							1000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.selection",
+							 "How victims are picked out of the candidates.",
+							 "\"random\" gives every candidate the same chance, "
+							 "\"oldest_query\" and \"oldest_xact\" hit the longest "
+							 "running queries or transactions first.",
+							 &selection,
+							 RAGE_SELECT_RANDOM,
+							 selection_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_rage_terminator.dry_run",
+							 "Pick victims without signaling them.",
+							 "Victims are counted, recorded and logged as usual.",
+							 &dry_run,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_rage_terminator.spare_critical",
+							 "Spare backends that are committing or hold an AccessExclusiveLock.",
+							 NULL,
+							 &spare_critical,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.standby_mode",
+							 "What the workers do on a standby.",
+							 "\"on\" rages like on a primary, \"off\" skips all rounds, "
+							 "\"read_only\" uses the native scan and only targets "
+							 "client sessions.",
+							 &standby_mode,
+							 RAGE_STANDBY_ON,
+							 standby_mode_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.cohort",
+							 "Groups of backends that are terminated together.",
+							 "\"client_addr\" hits all sessions of a client address, "
+							 "\"application_name\" all sessions of an application.",
+							 &cohort,
+							 RAGE_COHORT_NONE,
+							 cohort_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_rage_terminator.scan_mode",
+							 "Method used to look for backends to terminate.",
+							 "\"native\" reads the backend status array from shared memory, "
+							 "\"sql\" queries pg_stat_activity.",
+							 &scan_mode,
+							 scan_mode,
+							 scan_mode_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+}
+
+static Size
+pg_rage_terminator_shmem_size(void)
+{
+	Size		size;
+
+	size = add_size(offsetof(RageSharedState, workers),
+					mul_size(nworkers, sizeof(RageWorkerSlot)));
+	size = add_size(size, hash_estimate_size(max_stats,
+											 sizeof(RageStatsEntry)));
+	size = add_size(size, mul_size(history_size, sizeof(RageHistoryEntry)));
+	return size;
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+pg_rage_terminator_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pg_rage_terminator_shmem_size());
+	RequestNamedLWLockTranche("pg_rage_terminator", 1);
+}
+#endif
+
+static void
+pg_rage_terminator_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	rage_shared = ShmemInitStruct("pg_rage_terminator",
+								  pg_rage_terminator_shmem_size(),
+								  &found);
+	if (!found)
+	{
+		int			i;
+
+		SpinLockInit(&rage_shared->mutex);
+		rage_shared->budget.tokens = 0;
+		rage_shared->budget.refill_time = 0;
+		rage_shared->lock = &(GetNamedLWLockTranche("pg_rage_terminator"))->lock;
+		pg_atomic_init_u64(&rage_shared->stats_dropped, 0);
+		pg_atomic_init_u64(&rage_shared->history_next, 0);
+		rage_shared->nworkers = nworkers;
+		for (i = 0; i < nworkers; i++)
+		{
+			RageWorkerSlot *slot = &rage_shared->workers[i];
+
+			slot->pid = 0;
+			slot->latch = NULL;
+			slot->paused = false;
+			slot->fire_chance = -1;
+			pg_atomic_init_u64(&slot->fire_requested, 0);
+			pg_atomic_init_u64(&slot->fire_done, 0);
+			pg_atomic_init_u64(&slot->rounds, 0);
+			pg_atomic_init_u64(&slot->kills, 0);
+			pg_atomic_init_u64(&slot->cancels, 0);
+			pg_atomic_init_u64(&slot->dry_run_kills, 0);
+			pg_atomic_init_u64(&slot->dry_run_cancels, 0);
+			pg_atomic_init_u64(&slot->round_time, 0);
+			pg_atomic_init_u64(&slot->last_round_time, 0);
+			pg_atomic_init_u64(&slot->cpu_time, 0);
+			pg_atomic_init_u64(&slot->snapshot_time, 0);
+			pg_atomic_init_u64(&slot->signal_time, 0);
+			pg_atomic_init_u64(&slot->effective_interval, 0);
+			pg_atomic_init_u64(&slot->reconnect_time, 0);
+			pg_atomic_init_u64(&slot->skipped, 0);
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(RageStatsKey);
+	info.entrysize = sizeof(RageStatsEntry);
+	rage_stats = ShmemInitHash("pg_rage_terminator stats",
+							   max_stats, max_stats,
+							   &info,
+							   HASH_ELEM | HASH_BLOBS);
+
+	if (history_size > 0)
+	{
+		rage_history = ShmemInitStruct("pg_rage_terminator history",
+									   mul_size(history_size,
+												sizeof(RageHistoryEntry)),
+									   &found);
+		if (!found)
+		{
+			int			i;
+
+			for (i = 0; i < history_size; i++)
+			{
+				pg_atomic_init_u32(&rage_history[i].changecount, 0);
+				memset(&rage_history[i].kill, 0, sizeof(RageKill));
+			}
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
 }
 
 /*
- * Entry point for worker loading
+ * Fill in the registration of a terminator worker, shared by the static
+ * and the launched workers.
  */
-void
-_PG_init(void)
+static void
+pg_rage_terminator_init_worker(BackgroundWorker *worker)
 {
-	BackgroundWorker worker;
-
-	/* Add parameters */
-	pg_rage_terminator_load_params();
+	memset(worker, 0, sizeof(BackgroundWorker));
 
 	/* Worker parameter and registration */
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+	worker->bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker->bgw_start_time = BgWorkerStart_ConsistentState;
 
 	/*
 	 * bgw_main is considered a footgun, per commit
@@ -286,22 +4027,588 @@ _PG_init(void)
 	 * it here to get the initialization correct.
 	 */
 #if PG_VERSION_NUM < 100000
-	worker.bgw_main = NULL;
+	worker->bgw_main = NULL;
 #endif
 
-	snprintf(worker.bgw_library_name, BGW_MAXLEN - 1, "pg_rage_terminator");
-	snprintf(worker.bgw_function_name, BGW_MAXLEN - 1, "pg_rage_terminator_main");
+	snprintf(worker->bgw_library_name, BGW_MAXLEN - 1, "pg_rage_terminator");
+	snprintf(worker->bgw_function_name, BGW_MAXLEN - 1, "pg_rage_terminator_main");
 
-	snprintf(worker.bgw_name, BGW_MAXLEN, "%s", worker_name);
+	snprintf(worker->bgw_name, BGW_MAXLEN, "%s", worker_name);
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker->bgw_type, BGW_MAXLEN, "%s", worker_name);
+#endif
 	/* Wait 10 seconds for restart before crash */
-	worker.bgw_restart_time = 10;
-	worker.bgw_main_arg = (Datum) 0;
-#if PG_VERSION_NUM >= 90400
+	worker->bgw_restart_time = 10;
 	/*
-	 * Notify PID is present since 9.4. If this is not initialized
-	 * a static background worker cannot start properly.
+	 * If the notify PID is not initialized a static background worker
+	 * cannot start properly.
 	 */
-	worker.bgw_notify_pid = 0;
+	worker->bgw_notify_pid = 0;
+}
+
+/*
+ * Entry point for worker loading
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+	int			i;
+
+	/* Add parameters */
+	pg_rage_terminator_load_params();
+
+	/* Workers and shared memory are only set up at postmaster start */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	pg_rage_terminator_load_postmaster_params();
+
+	/* Install hooks */
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pg_rage_terminator_shmem_request;
+#else
+	RequestAddinShmemSpace(pg_rage_terminator_shmem_size());
+	RequestNamedLWLockTranche("pg_rage_terminator", 1);
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_rage_terminator_shmem_startup;
+
+	pg_rage_terminator_init_worker(&worker);
+
+	/* One worker per shard of the backends, the index is the argument */
+	for (i = 0; i < nworkers; i++)
+	{
+		if (nworkers == 1)
+			snprintf(worker.bgw_name, BGW_MAXLEN, "%s", worker_name);
+		else
+			snprintf(worker.bgw_name, BGW_MAXLEN, "%s %d", worker_name, i);
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+/*
+ * Build a tuplestore for a set returning function in materialize mode.
+ */
+static void
+pg_rage_terminator_init_srf(FunctionCallInfo fcinfo)
+{
+#if PG_VERSION_NUM >= 150000
+	InitMaterializedSRF(fcinfo, 0);
+#else
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
+
+	MemoryContextSwitchTo(oldcontext);
+#endif
+}
+
+static void
+pg_rage_terminator_check_shared(void)
+{
+	if (rage_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_rage_terminator must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * Kill statistics per database, role and client address.
+ */
+#define PG_RAGE_TERMINATOR_STATS_COLS	6
+
+Datum
+pg_rage_terminator_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	RageStatsEntry *entry;
+
+	pg_rage_terminator_check_shared();
+	pg_rage_terminator_init_srf(fcinfo);
+
+	LWLockAcquire(rage_shared->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, rage_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PG_RAGE_TERMINATOR_STATS_COLS];
+		bool		nulls[PG_RAGE_TERMINATOR_STATS_COLS];
+		TimestampTz last_kill;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(entry->key.datid);
+		values[1] = ObjectIdGetDatum(entry->key.userid);
+		if (entry->key.client_addr[0])
+			values[2] = DirectFunctionCall1(inet_in,
+											CStringGetDatum(entry->key.client_addr));
+		else
+			nulls[2] = true;
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->kills));
+		last_kill = (TimestampTz) pg_atomic_read_u64(&entry->last_kill);
+		if (last_kill != 0)
+			values[4] = TimestampTzGetDatum(last_kill);
+		else
+			nulls[4] = true;
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->dry_run_kills));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(rage_shared->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Round statistics per terminator worker.
+ */
+#define PG_RAGE_TERMINATOR_WORKERS_COLS	16
+
+Datum
+pg_rage_terminator_workers(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int			i;
+
+	pg_rage_terminator_check_shared();
+	pg_rage_terminator_init_srf(fcinfo);
+
+	for (i = 0; i < rage_shared->nworkers; i++)
+	{
+		RageWorkerSlot *slot = &rage_shared->workers[i];
+		Datum		values[PG_RAGE_TERMINATOR_WORKERS_COLS];
+		bool		nulls[PG_RAGE_TERMINATOR_WORKERS_COLS];
+		pid_t		pid;
+		bool		paused;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		SpinLockAcquire(&rage_shared->mutex);
+		pid = slot->pid;
+		paused = slot->paused;
+		SpinLockRelease(&rage_shared->mutex);
+
+		values[0] = Int32GetDatum(i);
+		if (pid != 0)
+			values[1] = Int32GetDatum((int32) pid);
+		else
+			nulls[1] = true;
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->rounds));
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->kills));
+		/* Times are reported in milliseconds */
+		values[4] = Float8GetDatum(pg_atomic_read_u64(&slot->round_time) / 1000.0);
+		values[5] = Float8GetDatum(pg_atomic_read_u64(&slot->last_round_time) / 1000.0);
+		values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->skipped));
+		values[7] = Float8GetDatum(pg_atomic_read_u64(&slot->cpu_time) / 1000.0);
+		values[8] = Float8GetDatum(pg_atomic_read_u64(&slot->snapshot_time) / 1000.0);
+		values[9] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->cancels));
+		values[10] = Float8GetDatum(pg_atomic_read_u64(&slot->signal_time) / 1000.0);
+		values[11] = BoolGetDatum(paused);
+		values[12] = Float8GetDatum((double) pg_atomic_read_u64(&slot->effective_interval));
+		values[13] = Float8GetDatum(pg_atomic_read_u64(&slot->reconnect_time) / 1000.0);
+		values[14] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->dry_run_kills));
+		values[15] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->dry_run_cancels));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Discard all kill statistics.
+ */
+Datum
+pg_rage_terminator_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	RageStatsEntry *entry;
+
+	pg_rage_terminator_check_shared();
+
+	LWLockAcquire(rage_shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, rage_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(rage_stats, &entry->key, HASH_REMOVE, NULL);
+
+	pg_atomic_write_u64(&rage_shared->stats_dropped, 0);
+
+	LWLockRelease(rage_shared->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Number of kills not counted because the statistics table was full.
+ */
+Datum
+pg_rage_terminator_stats_dropped(PG_FUNCTION_ARGS)
+{
+	pg_rage_terminator_check_shared();
+
+	PG_RETURN_INT64((int64) pg_atomic_read_u64(&rage_shared->stats_dropped));
+}
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * Look for running terminator workers, static or launched ones. If sig
+ * is not 0, the workers found are sent this signal. Returns the number of
+ * workers found.
+ */
+static int
+pg_rage_terminator_find_workers(int sig)
+{
+	int			num_backends;
+	int			found = 0;
+	int			i;
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		const char *type;
+
+		local_beentry = rage_fetch_local_beentry(i);
+		if (local_beentry == NULL)
+			continue;
+
+		beentry = &local_beentry->backendStatus;
+		if (beentry->st_backendType != B_BG_WORKER)
+			continue;
+
+		type = GetBackgroundWorkerTypeByPid(beentry->st_procpid);
+		if (type == NULL || strcmp(type, worker_name) != 0)
+			continue;
+
+		found++;
+		if (sig != 0 && kill(beentry->st_procpid, sig) != 0)
+			ereport(WARNING,
+					(errmsg("could not send signal to process %d: %m",
+							beentry->st_procpid)));
+	}
+
+	return found;
+}
+#endif
+
+/*
+ * Launch a terminator worker without restarting the server. The worker
+ * handles all backends and is not restarted once it exits. Returns the
+ * PID of the worker.
+ */
+Datum
+pg_rage_terminator_launch(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	pid_t		pid;
+
+	if (pg_rage_terminator_find_workers(0) > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_rage_terminator is already running")));
+
+	pg_rage_terminator_init_worker(&worker);
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	worker.bgw_main_arg = Int32GetDatum(RAGE_DYNAMIC_WORKER);
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register background process"),
+				 errhint("You may need to increase max_worker_processes.")));
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+	if (status == BGWH_STOPPED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start background process"),
+				 errhint("More details may be available in the server log.")));
+	if (status == BGWH_POSTMASTER_DIED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("cannot start background processes without postmaster"),
+				 errhint("Kill all remaining database processes and restart the database.")));
+	Assert(status == BGWH_STARTED);
+
+	PG_RETURN_INT32((int32) pid);
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_rage_terminator_launch() requires PostgreSQL 11 or newer")));
+	PG_RETURN_NULL();
+#endif
+}
+
+/*
+ * Stop all terminator workers. Static workers exit cleanly and are not
+ * restarted until the next server start. Returns the number of workers
+ * signaled.
+ */
+Datum
+pg_rage_terminator_stop(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 110000
+	PG_RETURN_INT32(pg_rage_terminator_find_workers(SIGTERM));
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_rage_terminator_stop() requires PostgreSQL 11 or newer")));
+	PG_RETURN_NULL();
+#endif
+}
+
+/*
+ * Kill history, oldest victim first. Entries being written while they
+ * are read are retried a few times, then skipped.
+ */
+#define PG_RAGE_TERMINATOR_HISTORY_COLS	9
+
+/*
+ * Put the history entries recorded since from into the result of a set
+ * returning function, as far as they are still in the ring buffer.
+ */
+static void
+pg_rage_terminator_history_rows(FunctionCallInfo fcinfo, uint64 from)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	uint64		next;
+	uint64		n;
+
+	if (rage_history == NULL)
+		return;
+
+	next = pg_atomic_read_u64(&rage_shared->history_next);
+	n = next > (uint64) history_size ? next - history_size : 0;
+	for (n = Max(n, from); n < next; n++)
+	{
+		RageHistoryEntry *entry = &rage_history[n % history_size];
+		Datum		values[PG_RAGE_TERMINATOR_HISTORY_COLS];
+		bool		nulls[PG_RAGE_TERMINATOR_HISTORY_COLS];
+		RageKill	kill;
+		char		client_addr[RAGE_ADDR_LEN];
+		const char *state = NULL;
+		bool		valid = false;
+		int			retry;
+		int			i;
+
+		for (retry = 0; retry < 3 && !valid; retry++)
+		{
+			uint32		before;
+			uint32		after;
+
+			before = pg_atomic_read_u32(&entry->changecount);
+			pg_read_barrier();
+			memcpy(&kill, &entry->kill, sizeof(RageKill));
+			pg_read_barrier();
+			after = pg_atomic_read_u32(&entry->changecount);
+
+			valid = before == after && (before & 1) == 0 && before != 0 &&
+				kill.seq == n;
+		}
+
+		if (!valid)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(kill.pid);
+		values[1] = TimestampTzGetDatum(kill.kill_time);
+		values[2] = ObjectIdGetDatum(kill.datid);
+		values[3] = ObjectIdGetDatum(kill.userid);
+		pg_rage_terminator_format_addr(&kill.client_addr, client_addr,
+									   sizeof(client_addr));
+		if (client_addr[0])
+			values[4] = DirectFunctionCall1(inet_in,
+											CStringGetDatum(client_addr));
+		else
+			nulls[4] = true;
+		if (kill.query_id != 0)
+			values[5] = Int64GetDatum(kill.query_id);
+		else
+			nulls[5] = true;
+		for (i = 0; state_names[i].name != NULL; i++)
+		{
+			if (state_names[i].state == kill.state)
+			{
+				state = state_names[i].name;
+				break;
+			}
+		}
+		if (state != NULL)
+			values[6] = CStringGetTextDatum(state);
+		else
+			nulls[6] = true;
+		values[7] = CStringGetTextDatum(kill.canceled ? "cancel" : "terminate");
+		values[8] = BoolGetDatum(kill.dry_run);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+}
+
+Datum
+pg_rage_terminator_history(PG_FUNCTION_ARGS)
+{
+	pg_rage_terminator_check_shared();
+	pg_rage_terminator_init_srf(fcinfo);
+	pg_rage_terminator_history_rows(fcinfo, 0);
+
+	return (Datum) 0;
+}
+
+/*
+ * Sleep a little while pg_rage_terminator_fire() waits on the workers.
+ */
+static void
+pg_rage_terminator_fire_sleep(void)
+{
+#if PG_VERSION_NUM >= 120000
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+					 10L, PG_WAIT_EXTENSION);
+#else
+	int			rc;
+
+	rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				   10L
+#if PG_VERSION_NUM >= 100000
+				   , PG_WAIT_EXTENSION
+#endif
+		);
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
 #endif
-	RegisterBackgroundWorker(&worker);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Have every running worker do a kill round right now, and wait for them
+ * to finish. A chance of NULL uses the settings. Returns the victims of
+ * the rounds, taken from the kill history.
+ */
+Datum
+pg_rage_terminator_fire(PG_FUNCTION_ARGS)
+{
+	uint64	   *targets;
+	uint64		from;
+	int			fire_chance = -1;
+	int			nrunning = 0;
+	int			i;
+
+	pg_rage_terminator_check_shared();
+
+	if (!PG_ARGISNULL(0))
+	{
+		fire_chance = PG_GETARG_INT32(0);
+		if (fire_chance < 0 || fire_chance > 100)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("chance must be between 0 and 100")));
+	}
+
+	pg_rage_terminator_init_srf(fcinfo);
+	from = pg_atomic_read_u64(&rage_shared->history_next);
+
+	/*
+	 * Ask the running workers for a round and wake them up. A round can
+	 * serve the requests of several callers only if they asked for the
+	 * same chance, otherwise wait for the pending requests first.
+	 */
+	targets = palloc0(rage_shared->nworkers * sizeof(uint64));
+	for (i = 0; i < rage_shared->nworkers; i++)
+	{
+		RageWorkerSlot *slot = &rage_shared->workers[i];
+		Latch	   *latch;
+
+		for (;;)
+		{
+			SpinLockAcquire(&rage_shared->mutex);
+			latch = slot->pid != 0 ? slot->latch : NULL;
+			if (latch == NULL)
+			{
+				SpinLockRelease(&rage_shared->mutex);
+				break;
+			}
+			if (slot->fire_chance == fire_chance ||
+				pg_atomic_read_u64(&slot->fire_requested) ==
+				pg_atomic_read_u64(&slot->fire_done))
+			{
+				slot->fire_chance = fire_chance;
+				targets[i] = pg_atomic_add_fetch_u64(&slot->fire_requested, 1);
+				SpinLockRelease(&rage_shared->mutex);
+				break;
+			}
+			SpinLockRelease(&rage_shared->mutex);
+
+			pg_rage_terminator_fire_sleep();
+		}
+
+		if (latch == NULL)
+			continue;
+
+		SetLatch(latch);
+		nrunning++;
+	}
+
+	if (nrunning == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no pg_rage_terminator worker is running")));
+
+	/* Wait for the rounds, a worker that exited is not waited for */
+	for (i = 0; i < rage_shared->nworkers; i++)
+	{
+		RageWorkerSlot *slot = &rage_shared->workers[i];
+
+		while (targets[i] != 0 &&
+			   pg_atomic_read_u64(&slot->fire_done) < targets[i])
+		{
+			pid_t		pid;
+
+			SpinLockAcquire(&rage_shared->mutex);
+			pid = slot->pid;
+			SpinLockRelease(&rage_shared->mutex);
+			if (pid == 0)
+				break;
+
+			pg_rage_terminator_fire_sleep();
+		}
+	}
+	pfree(targets);
+
+	pg_rage_terminator_history_rows(fcinfo, from);
+
+	return (Datum) 0;
 }
@@ -0,0 +1,102 @@
+CREATE EXTENSION pg_rage_terminator;
+
+-- Stop before any round is fired unless the server runs with
+-- pg_rage_terminator.conf, on any other server the rounds would hit real
+-- sessions
+\set ON_ERROR_STOP 1
+DO $$
+BEGIN
+    IF current_setting('pg_rage_terminator.dry_run') <> 'on' OR
+       current_setting('pg_rage_terminator.application_names') <> 'rage_regress' THEN
+        RAISE EXCEPTION 'the server does not run with pg_rage_terminator.conf';
+    END IF;
+END
+$$;
+\set ON_ERROR_STOP 0
+
+-- The server runs with pg_rage_terminator.conf: only sessions named
+-- rage_regress are hit, in dry run mode, and only by fired rounds
+SET application_name = 'rage_regress';
+
+-- Fire rounds until one finds a victim, or none, after a reload
+CREATE FUNCTION rage_wait(want_victim bool) RETURNS bool
+LANGUAGE plpgsql AS $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        IF EXISTS (SELECT 1 FROM pg_rage_terminator_fire(100)) = want_victim THEN
+            RETURN true;
+        END IF;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN false;
+END
+$$;
+
+-- The worker may still be starting
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        EXIT WHEN EXISTS (SELECT 1 FROM pg_rage_terminator_workers
+                          WHERE pid IS NOT NULL);
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END
+$$;
+
+-- Counters of earlier runs
+SELECT count(*) FROM pg_rage_terminator_stats_reset();
+SELECT sum(kills) AS kills, sum(dry_run_kills) AS dry_run_kills
+  FROM pg_rage_terminator_workers \gset
+
+-- A chance of 0 never picks anybody
+SELECT count(*) FROM pg_rage_terminator_fire(0);
+
+-- A chance of 100 picks this session, without signaling it
+SELECT pid = pg_backend_pid() AND state = 'active' AND
+       action = 'terminate' AND dry_run AS ok
+  FROM pg_rage_terminator_fire(100);
+
+-- Other application names are left alone
+SET application_name = 'rage_regress_other';
+SELECT count(*) FROM pg_rage_terminator_fire(100);
+SET application_name = 'rage_regress';
+
+SELECT count(*) FROM pg_rage_terminator_fire(101);
+SELECT count(*) FROM pg_rage_terminator_fire(-1);
+
+-- The dry run victim is in the history and counted apart from real kills
+SELECT count(*) FROM pg_rage_terminator_history
+ WHERE pid = pg_backend_pid() AND dry_run AND
+       kill_time > now() - interval '1 hour';
+SELECT kills = 0 AND dry_run_kills = 1 AND last_kill IS NULL AS ok
+  FROM pg_rage_terminator_stats
+ WHERE datname = current_database() AND usename = current_user;
+SELECT sum(kills) = :kills AND sum(dry_run_kills) = :dry_run_kills + 1 AS ok
+  FROM pg_rage_terminator_workers;
+
+-- Filters follow a reload
+ALTER SYSTEM SET pg_rage_terminator.application_names = 'rage_regress_reload';
+SELECT pg_reload_conf();
+SET application_name = 'rage_regress_reload';
+SELECT rage_wait(true);
+
+ALTER SYSTEM SET pg_rage_terminator.client_addrs = '192.0.2.1';
+SELECT pg_reload_conf();
+SELECT rage_wait(false);
+
+ALTER SYSTEM SET pg_rage_terminator.client_addrs = '';
+SELECT pg_reload_conf();
+SELECT rage_wait(true);
+
+-- Unknown names only match nothing
+ALTER SYSTEM SET pg_rage_terminator.databases = 'rage_regress_nodb';
+SELECT pg_reload_conf();
+SELECT rage_wait(false);
+
+ALTER SYSTEM RESET pg_rage_terminator.application_names;
+ALTER SYSTEM RESET pg_rage_terminator.client_addrs;
+ALTER SYSTEM RESET pg_rage_terminator.databases;
+SELECT pg_reload_conf();
+
+DROP FUNCTION rage_wait(bool);
+DROP EXTENSION pg_rage_terminator;
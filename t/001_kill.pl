@@ -0,0 +1,142 @@
+# Kill rounds against real sessions: termination, cancel, selection of the
+# oldest queries, and the victims of a storm.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use IPC::Run;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'pg_rage_terminator'
+pg_rage_terminator.interval = 0
+pg_rage_terminator.application_names = 'rage_victim'
+});
+$node->start;
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_rage_terminator');
+$node->poll_query_until('postgres',
+	'SELECT count(*) > 0 FROM pg_rage_terminator_workers WHERE pid IS NOT NULL')
+  or die 'worker did not start';
+
+my @victims;
+my %stderr;
+
+# Start a session named rage_victim running a long query, and return its PID.
+# Only the victim gets the name, the sessions of the test itself are never
+# candidates.
+sub start_victim
+{
+	my $err = '';
+	my $known = join(',', 0, keys %stderr);
+
+	push @victims,
+	  IPC::Run::start(
+		[
+			'psql', '-X', '-d',
+			$node->connstr('postgres') . ' application_name=rage_victim',
+			'-c', 'SELECT pg_sleep(600)'
+		],
+		'>', \my $out, '2>', \$err);
+
+	my $query = "SELECT pid FROM pg_stat_activity
+				  WHERE query = 'SELECT pg_sleep(600)' AND state = 'active'
+					AND pid <> pg_backend_pid() AND pid NOT IN ($known)";
+	$node->poll_query_until('postgres', "SELECT count(*) = 1 FROM ($query) v")
+	  or die 'victim did not start';
+
+	my $pid = $node->safe_psql('postgres', $query);
+	$stderr{$pid} = \$err;
+	return $pid;
+}
+
+sub stop_victims
+{
+	$_->kill_kill for @victims;
+	@victims = ();
+	%stderr = ();
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name = 'rage_victim'");
+}
+
+sub restart_with
+{
+	my ($conf) = @_;
+
+	stop_victims();
+	$node->append_conf('postgresql.conf', $conf);
+	$node->restart;
+	$node->poll_query_until('postgres',
+		'SELECT count(*) > 0 FROM pg_rage_terminator_workers WHERE pid IS NOT NULL')
+	  or die 'worker did not start';
+}
+
+# A chance of 0 leaves everybody alone
+my $pid = start_victim();
+is($node->safe_psql('postgres', 'SELECT count(*) FROM pg_rage_terminator_fire(0)'),
+	'0', 'chance 0 picks nobody');
+
+# A chance of 100 terminates every candidate, and only candidates
+my $pid2 = start_victim();
+is( $node->safe_psql('postgres',
+		"SELECT string_agg(pid::text || ' ' || action, ',' ORDER BY pid)
+		   FROM pg_rage_terminator_fire(100)"),
+	join(',', map { "$_ terminate" } sort { $a <=> $b } ($pid, $pid2)),
+	'chance 100 terminates all victims');
+ok( $node->poll_query_until('postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE pid IN ($pid, $pid2)"),
+	'victims are gone');
+is( $node->safe_psql('postgres',
+		"SELECT sum(kills) FROM pg_rage_terminator_stats WHERE datname = 'postgres'"),
+	'2', 'kills are counted');
+is( $node->safe_psql('postgres',
+		"SELECT count(*) FROM pg_rage_terminator_history
+		  WHERE pid IN ($pid, $pid2) AND action = 'terminate' AND NOT dry_run"),
+	'2', 'kills are in the history');
+stop_victims();
+
+# Cancel mode only cancels the query
+restart_with("pg_rage_terminator.kill_mode = 'cancel'\n");
+$pid = start_victim();
+is( $node->safe_psql('postgres',
+		'SELECT action FROM pg_rage_terminator_fire(100)'),
+	'cancel', 'cancel mode cancels');
+$victims[-1]->finish;
+like(${ $stderr{$pid} }, qr/canceling statement due to user request/,
+	'query has been canceled');
+
+# The oldest query is picked first within the kill budget of a round
+restart_with("pg_rage_terminator.kill_mode = 'terminate'\n"
+	  . "pg_rage_terminator.selection = 'oldest_query'\n"
+	  . "pg_rage_terminator.max_kills_per_round = 1\n");
+my $oldest = start_victim();
+start_victim();
+start_victim();
+is($node->safe_psql('postgres', 'SELECT pid FROM pg_rage_terminator_fire(100)'),
+	$oldest, 'oldest_query picks the oldest query');
+
+# Victims of a storm are signaled one after the other over its window
+restart_with("pg_rage_terminator.selection = 'random'\n"
+	  . "pg_rage_terminator.max_kills_per_round = 0\n"
+	  . "pg_rage_terminator.interval = 1s\n"
+	  . "pg_rage_terminator.chance = 0\n"
+	  . "pg_rage_terminator.storm_window = 4s\n");
+# The storm only starts once both victims are known
+$pid = start_victim();
+$pid2 = start_victim();
+$node->append_conf('postgresql.conf', "pg_rage_terminator.chance = 100\n");
+$node->reload;
+ok( $node->poll_query_until('postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE pid IN ($pid, $pid2)"),
+	'storm terminates all victims');
+is( $node->safe_psql('postgres',
+		"SELECT count(DISTINCT kill_time) FROM pg_rage_terminator_history
+		  WHERE pid IN ($pid, $pid2)"),
+	'2', 'storm victims are signaled apart');
+stop_victims();
+
+$node->stop;
+
+done_testing();
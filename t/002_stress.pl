@@ -0,0 +1,114 @@
+# Kill rounds over thousands of idle connections: the round latency and the
+# memory of the worker have to stay within budget. In dry run mode, so the
+# connections stay the same throughout.
+#
+# RAGE_STRESS_CONNECTIONS (default 1000), RAGE_STRESS_DURATION (seconds,
+# default 30), RAGE_STRESS_MAX_ROUND_MS (default 50) and
+# RAGE_STRESS_MAX_RSS_GROWTH_KB (default 1024) change the test.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use IPC::Run;
+
+my $connections = $ENV{RAGE_STRESS_CONNECTIONS} || 1000;
+my $duration = $ENV{RAGE_STRESS_DURATION} || 30;
+my $max_round_ms = $ENV{RAGE_STRESS_MAX_ROUND_MS} || 50;
+my $max_rss_growth = $ENV{RAGE_STRESS_MAX_RSS_GROWTH_KB} || 1024;
+
+my $node = PostgreSQL::Test::Cluster->new('stress');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'pg_rage_terminator'
+max_connections = @{[ $connections + 20 ]}
+pg_rage_terminator.interval = 100ms
+pg_rage_terminator.chance = 100
+pg_rage_terminator.dry_run = on
+pg_rage_terminator.log_kills = 'summary'
+pg_rage_terminator.application_names = 'pgbench'
+});
+$node->start;
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_rage_terminator');
+
+# Largest resident set size of the workers in kB
+sub worker_rss
+{
+	my $max = 0;
+
+	foreach my $pid (split /\n/,
+		$node->safe_psql('postgres',
+			'SELECT pid FROM pg_rage_terminator_workers WHERE pid IS NOT NULL'))
+	{
+		open(my $fh, '<', "/proc/$pid/status") or next;
+		while (<$fh>)
+		{
+			$max = $1 if /^VmRSS:\s+(\d+)/ && $1 > $max;
+		}
+		close($fh);
+	}
+
+	return $max;
+}
+
+# Clients spend nearly all their time idle
+my $script = PostgreSQL::Test::Utils::tempdir() . '/idle.sql';
+PostgreSQL::Test::Utils::append_to_file($script, "\\sleep 1 s\nSELECT 1;\n");
+
+# PostgreSQL::Test::Utils names every session after the script, which libpq
+# prefers over the fallback name of pgbench
+my ($out, $err) = ('', '');
+my $pgbench;
+{
+	local $ENV{PGAPPNAME} = 'pgbench';
+	$pgbench = IPC::Run::start(
+		[
+			'pgbench', '-n', '-c', $connections, '-j',
+			($connections < 16 ? $connections : 16),
+			'-T', $duration * 2 + 300, '-f', $script, $node->connstr('postgres')
+		],
+		'>', \$out, '2>', \$err);
+}
+
+ok( $node->poll_query_until('postgres',
+		"SELECT count(*) >= $connections FROM pg_stat_activity
+		  WHERE application_name = 'pgbench'"),
+	"$connections connections are open");
+
+# Warm up, so the buffers of a full round have been allocated once
+sleep(2);
+my $rss_before = worker_rss();
+my ($rounds_before, $time_before, $victims_before) = split /\|/,
+  $node->safe_psql('postgres',
+	'SELECT sum(rounds), sum(total_time), sum(dry_run_kills) FROM pg_rage_terminator_workers');
+
+sleep($duration);
+
+my ($rounds_after, $time_after, $victims_after) = split /\|/,
+  $node->safe_psql('postgres',
+	'SELECT sum(rounds), sum(total_time), sum(dry_run_kills) FROM pg_rage_terminator_workers');
+my $rss_after = worker_rss();
+my $rounds = $rounds_after - $rounds_before;
+
+cmp_ok($rounds, '>', 0, 'rounds were done');
+# A round is counted before its victims, the last one may still be running
+cmp_ok($victims_after - $victims_before, '>=', ($rounds - 1) * $connections,
+	'every round picked all connections');
+
+my $round_ms = $rounds > 0 ? ($time_after - $time_before) / $rounds : 0;
+note(sprintf('%d rounds, %.3f ms per round, worker RSS %d kB to %d kB',
+		$rounds, $round_ms, $rss_before, $rss_after));
+cmp_ok($round_ms, '<=', $max_round_ms, 'round latency is within budget');
+
+SKIP:
+{
+	skip 'worker RSS not readable', 1 if $rss_before == 0;
+	cmp_ok($rss_after - $rss_before, '<=', $max_rss_growth,
+		'worker memory stays flat');
+}
+
+$pgbench->kill_kill;
+$node->stop;
+
+done_testing();